@@ -0,0 +1,379 @@
+/*
+ * Bitstream parsing, see bitstream.h
+ *
+ *  Relevant Documents:
+ *  -------------------
+ *  FPGA-TN-02039, ECP5 and ECP5-5G sysCONFIG Usage Guide
+ *  Project Trellis bitstream documentation
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bitstream.h"
+
+/* Commands found in bitstreams, which differ from the JTAG instructions of
+ * the same name in lattice_cmds.h */
+enum bitstream_cmd {
+	BIT_LSC_RESET_CRC = 0x3B,
+	BIT_VERIFY_ID = 0xE2,
+	BIT_LSC_WRITE_COMP_DIC = 0x02,
+	BIT_LSC_PROG_CNTRL0 = 0x22,
+	BIT_LSC_INIT_ADDRESS = 0x46,
+	BIT_LSC_WRITE_ADDRESS = 0xB4,
+	BIT_LSC_PROG_INCR_RTI = 0x82,
+	BIT_LSC_PROG_INCR_CMP = 0xB8,
+	BIT_LSC_PROG_SED_CRC = 0xA2,
+	BIT_ISC_PROGRAM_USERCODE = 0xC2,
+	BIT_ISC_PROGRAM_SECURITY = 0xCE,
+	BIT_ISC_PROGRAM_DONE = 0x5E,
+	BIT_LSC_EBR_ADDRESS = 0xF6,
+	BIT_LSC_EBR_WRITE = 0xB2,
+	BIT_LSC_SPI_MODE = 0x79,
+	BIT_JUMP = 0x7E,
+	BIT_DUMMY = 0xFF,
+};
+
+#define CMD_CRC 0x80 /* in the first parameter byte */
+
+/* Skips the comment block and the padding in front of the preamble */
+static bool find_preamble(const uint8_t *data, size_t len, struct bitstream_info *info)
+{
+	size_t i = 0;
+
+	if (len >= 2 && data[0] == 0xFF && data[1] == 0x00) {
+		/* NUL-terminated strings, up to the next 0xFF */
+		for (i = 2; i < len && data[i] != 0xFF; i++)
+			;
+	}
+
+	size_t padding = i;
+	while (i < len && data[i] == 0xFF)
+		i++;
+	if (i == padding || i + 1 >= len || data[i] != 0xBD || data[i + 1] != 0xB3)
+		return false;
+
+	info->preamble = i;
+	info->start = (i - padding > BITSTREAM_PAD_KEEP) ? i - BITSTREAM_PAD_KEEP : padding;
+	return true;
+}
+
+/* Length of the operand of the commands of fixed length, -1 for the
+ * frame and EBR data commands and any unknown command */
+static int operand_length(uint8_t op)
+{
+	switch (op) {
+	case BIT_LSC_RESET_CRC:
+	case BIT_LSC_INIT_ADDRESS:
+	case BIT_LSC_SPI_MODE:
+	case BIT_ISC_PROGRAM_SECURITY:
+	case BIT_ISC_PROGRAM_DONE:
+		return 0;
+	case BIT_VERIFY_ID:
+	case BIT_LSC_PROG_CNTRL0:
+	case BIT_LSC_WRITE_ADDRESS:
+	case BIT_LSC_PROG_SED_CRC:
+	case BIT_ISC_PROGRAM_USERCODE:
+	case BIT_LSC_EBR_ADDRESS:
+	case BIT_JUMP:
+		return 4;
+	case BIT_LSC_WRITE_COMP_DIC:
+		return 8;
+	default:
+		return -1;
+	}
+}
+
+/* True if a CRC follows the command at 'cmd'. The first parameter of
+ * LSC_SPI_MODE is the SPI read mode, not flags. */
+static bool has_crc(const uint8_t *cmd)
+{
+	return cmd[0] != BIT_LSC_SPI_MODE && (cmd[1] & CMD_CRC);
+}
+
+/* Walks the commands after the preamble until the configuration frames */
+static void parse_header(const uint8_t *data, size_t len, struct bitstream_info *info)
+{
+	size_t i = info->preamble + 2;
+
+	while (i < len) {
+		uint8_t op = data[i];
+
+		if (op == BIT_DUMMY) {
+			i++;
+			continue;
+		}
+		if (op == BIT_LSC_PROG_INCR_CMP)
+			info->compressed = true;
+
+		int n = operand_length(op);
+		if (n < 0 || i + 4 + n > len)
+			break;
+
+		const uint8_t *operand = data + i + 4;
+		if (op == BIT_VERIFY_ID) {
+			info->has_idcode = true;
+			info->idcode = (uint32_t)operand[0] << 24 | operand[1] << 16 | operand[2] << 8 | operand[3];
+		} else if (op == BIT_LSC_WRITE_COMP_DIC) {
+			info->compressed = true;
+		}
+
+		i += 4 + n + has_crc(data + i) * 2;
+	}
+}
+
+/* Commands that may follow ISC_PROGRAM_USERCODE at the end of a bitstream */
+static bool is_trailer_command(uint8_t op)
+{
+	switch (op) {
+	case BIT_ISC_PROGRAM_USERCODE:
+	case BIT_ISC_PROGRAM_SECURITY:
+	case BIT_ISC_PROGRAM_DONE:
+	case BIT_LSC_PROG_SED_CRC:
+	case BIT_LSC_EBR_ADDRESS:
+	case BIT_LSC_RESET_CRC:
+	case BIT_LSC_SPI_MODE:
+	case BIT_JUMP:
+	case BIT_DUMMY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* The USERCODE is programmed after the configuration frames, whose length
+ * depends on the device. Rather than decoding the frames, search backwards
+ * for the last well-formed ISC_PROGRAM_USERCODE command. */
+static void find_usercode(const uint8_t *data, size_t len, struct bitstream_info *info)
+{
+	for (size_t i = len; i-- > info->preamble + 2; ) {
+		const uint8_t *cmd = data + i;
+		if (len - i < 8 || cmd[0] != BIT_ISC_PROGRAM_USERCODE ||
+		    (cmd[1] & ~CMD_CRC) != 0 || cmd[2] != 0 || cmd[3] != 0)
+			continue;
+
+		size_t next = i + 8 + ((cmd[1] & CMD_CRC) ? 2 : 0);
+		if (next < len && !is_trailer_command(data[next]))
+			continue;
+
+		info->has_usercode = true;
+		info->usercode = (uint32_t)cmd[4] << 24 | cmd[5] << 16 | cmd[6] << 8 | cmd[7];
+		return;
+	}
+}
+
+int bitstream_parse(const uint8_t *data, size_t len, struct bitstream_info *info)
+{
+	memset(info, 0, sizeof(*info));
+
+	if (!find_preamble(data, len, info))
+		return -1;
+
+	parse_header(data, len, info);
+	find_usercode(data, len, info);
+	return 0;
+}
+
+size_t bitstream_padding(const uint8_t *data, size_t len)
+{
+	size_t end = len;
+	while (end > 0 && data[end - 1] == 0xFF)
+		end--;
+	return len - end;
+}
+
+/* CRC-16 with polynomial 0x8005, MSB first, as the configuration logic
+ * computes it over the bytes of the bitstream */
+static uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	static uint16_t table[256];
+
+	if (!table[1]) {
+		for (int i = 0; i < 256; i++) {
+			uint16_t c = i << 8;
+			for (int j = 0; j < 8; j++)
+				c = (c & 0x8000) ? (c << 1) ^ 0x8005 : c << 1;
+			table[i] = c;
+		}
+	}
+
+	for (size_t i = 0; i < len; i++)
+		crc = (crc << 8) ^ table[(crc >> 8) ^ data[i]];
+	return crc;
+}
+
+enum crc_state {
+	CRC_SKIP,        /* up to the end of the preamble */
+	CRC_COMMAND,
+	CRC_OPERAND,
+	CRC_STORED,      /* CRC after a command, a frame or EBR data */
+	CRC_FRAME,
+	CRC_FRAME_DUMMY,
+};
+
+/* Longest configuration frame looked for */
+#define MAX_FRAME_BYTES 1024
+
+/* An EBR write carries 72-bit words */
+#define EBR_WORD_BYTES 9
+
+static uint16_t stored_crc(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/* The frame length depends on the device and isn't in the bitstream: it
+ * is the length after which the CRC stored behind the first frame matches,
+ * and the one behind the second frame as well. 0 if 'data' has no match. */
+static uint32_t find_frame_bytes(const struct bitstream_crc *c, const uint8_t *data, size_t len)
+{
+	uint16_t crc = c->crc;
+
+	for (uint32_t n = 1; n <= MAX_FRAME_BYTES && n + 2 <= len; n++) {
+		crc = crc16_update(crc, data + n - 1, 1);
+		if (crc != stored_crc(data + n))
+			continue;
+		if (c->frames < 2)
+			return n;
+
+		size_t second = n + 2 + c->frame_dummy;
+		if (second + n + 2 > len)
+			return 0;
+		if (crc16_update(0, data + n + 2, c->frame_dummy + n) == stored_crc(data + second + n))
+			return n;
+	}
+	return 0;
+}
+
+/* Starts the frames of LSC_PROG_INCR_RTI, whose first bytes are in 'data' */
+static void crc_frames(struct bitstream_crc *c, const uint8_t *data, size_t len)
+{
+	c->frames = c->cmd[2] << 8 | c->cmd[3];
+	c->frame_dummy = c->cmd[1] & 0x0F;
+	c->frame_crc = c->cmd[1] & CMD_CRC;
+	if (!c->frames) {
+		c->state = CRC_COMMAND;
+		return;
+	}
+
+	if (!c->frame_bytes && c->frame_crc)
+		c->frame_bytes = find_frame_bytes(c, data, len);
+	if (!c->frame_bytes) {
+		c->lost = true;
+		return;
+	}
+	c->state = CRC_FRAME;
+	c->remaining = c->frame_bytes;
+}
+
+/* Handles the command in 'c->cmd', 'data' follows it */
+static void crc_command(struct bitstream_crc *c, const uint8_t *data, size_t len)
+{
+	uint8_t op = c->cmd[0];
+	int n = operand_length(op);
+
+	if (op == BIT_LSC_RESET_CRC) {
+		c->crc = 0;
+		return;
+	}
+	if (op == BIT_LSC_PROG_INCR_RTI) {
+		crc_frames(c, data, len);
+		return;
+	}
+	if (op == BIT_LSC_EBR_WRITE)
+		n = (c->cmd[2] << 8 | c->cmd[3]) * EBR_WORD_BYTES;
+	if (n < 0) {
+		/* Compressed frames and unknown commands */
+		c->lost = true;
+		return;
+	}
+	c->state = CRC_OPERAND;
+	c->remaining = n;
+}
+
+/* Moves on from a frame, its CRC or its dummy bytes */
+static void crc_next_frame(struct bitstream_crc *c)
+{
+	if (c->state != CRC_FRAME_DUMMY && c->frame_dummy) {
+		c->state = CRC_FRAME_DUMMY;
+		c->remaining = c->frame_dummy;
+	} else if (--c->frames) {
+		c->state = CRC_FRAME;
+		c->remaining = c->frame_bytes;
+	} else {
+		c->state = CRC_COMMAND;
+	}
+}
+
+/* The operand, frame or dummy bytes of the current state are done */
+static void crc_done(struct bitstream_crc *c)
+{
+	bool checked = (c->state == CRC_OPERAND) ? has_crc(c->cmd) : (c->state == CRC_FRAME && c->frame_crc);
+
+	if (checked) {
+		c->state = CRC_STORED;
+		c->remaining = 2;
+	} else if (c->state == CRC_OPERAND) {
+		c->state = CRC_COMMAND;
+	} else {
+		crc_next_frame(c);
+	}
+}
+
+void bitstream_crc_init(struct bitstream_crc *c, const struct bitstream_info *info)
+{
+	memset(c, 0, sizeof(*c));
+	c->state = CRC_SKIP;
+	if (info)
+		c->remaining = info->preamble + 2 - info->start;
+	else
+		c->lost = true;
+}
+
+void bitstream_crc_update(struct bitstream_crc *c, const uint8_t *data, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len && !c->lost) {
+		size_t n = (c->remaining < len - i) ? c->remaining : len - i;
+
+		switch (c->state) {
+		case CRC_SKIP:
+			i += n;
+			c->remaining -= n;
+			if (!c->remaining)
+				c->state = CRC_COMMAND;
+			break;
+		case CRC_COMMAND:
+			c->crc = crc16_update(c->crc, data + i, 1);
+			c->cmd[c->cmd_len++] = data[i++];
+			if (c->cmd[0] == BIT_DUMMY) {
+				c->cmd_len = 0;
+			} else if (c->cmd_len == 4) {
+				c->cmd_len = 0;
+				crc_command(c, data + i, len - i);
+			}
+			break;
+		case CRC_STORED:
+			c->stored = c->stored << 8 | data[i++];
+			if (--c->remaining)
+				break;
+			if (c->stored != c->crc)
+				c->lost = true;
+			c->crc = 0;
+			if (c->frames)
+				crc_next_frame(c);
+			else
+				c->state = CRC_COMMAND;
+			break;
+		default:
+			c->crc = crc16_update(c->crc, data + i, n);
+			i += n;
+			c->remaining -= n;
+			if (!c->remaining)
+				crc_done(c);
+			break;
+		}
+	}
+}
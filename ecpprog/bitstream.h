@@ -0,0 +1,72 @@
+/*
+ * ECP5 / NX bitstream structure
+ *
+ * A bitstream file starts with an optional comment block (0xFF 0x00, text,
+ * 0x00 0xFF), then 0xFF padding and the 0xBDB3 preamble. Configuration
+ * commands follow, each an opcode, three parameter bytes and an operand
+ * whose length depends on the command. When bit 7 of the first parameter
+ * byte is set, a CRC-16 over the command follows the operand.
+ */
+
+#ifndef __BITSTREAM_H__
+#define __BITSTREAM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* 0xFF bytes kept next to the payload when padding is stripped */
+#define BITSTREAM_PAD_KEEP 16
+
+struct bitstream_info {
+	size_t   preamble;      /* offset of the 0xBDB3 preamble */
+	size_t   start;         /* first byte worth sending: comments and all but
+	                           BITSTREAM_PAD_KEEP bytes of padding skipped */
+	bool     has_idcode;
+	uint32_t idcode;        /* from VERIFY_ID */
+	bool     compressed;
+	bool     has_usercode;
+	uint32_t usercode;      /* from ISC_PROGRAM_USERCODE */
+};
+
+/**
+ * Scans 'len' bytes of bitstream. The header, up to the configuration
+ * frames, is decoded when 'data' holds it; the USERCODE is only found when
+ * 'data' extends to the end of the bitstream. Returns -1 if the data doesn't
+ * start like a bitstream.
+ */
+int bitstream_parse(const uint8_t *data, size_t len, struct bitstream_info *info);
+
+/* Number of 0xFF padding bytes at the end of 'data' */
+size_t bitstream_padding(const uint8_t *data, size_t len);
+
+/*
+ * The configuration logic's 16-bit frame CRC, followed over a bitstream
+ * sent in pieces. It runs from the preamble, restarts at each LSC_RESET_CRC
+ * and after each command, frame or EBR block whose CRC is checked, so at
+ * the end it holds what LSC_READ_CRC reads back. Every CRC stored in the
+ * bitstream is checked against it along the way.
+ */
+struct bitstream_crc {
+	uint16_t crc;
+	bool     lost;          /* a command the model can't follow, or a
+	                           stored CRC it disagrees with */
+	int      state;
+	size_t   remaining;     /* bytes left in the current state */
+	uint8_t  cmd[4];        /* opcode and parameters */
+	unsigned cmd_len;
+	uint16_t stored;        /* CRC read from the bitstream */
+	uint32_t frames;        /* left in the current LSC_PROG_INCR_RTI */
+	uint32_t frame_bytes;   /* found from the first frames' CRCs */
+	uint8_t  frame_dummy;   /* 0xFF bytes after each frame */
+	bool     frame_crc;
+};
+
+/* Starts the model on a bitstream sent from 'info->start', or as lost
+ * when 'info' is NULL */
+void bitstream_crc_init(struct bitstream_crc *c, const struct bitstream_info *info);
+
+/* Feeds the next 'len' bytes sent */
+void bitstream_crc_update(struct bitstream_crc *c, const uint8_t *data, size_t len);
+
+#endif
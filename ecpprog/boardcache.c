@@ -0,0 +1,259 @@
+/*
+ * Per-board flash content record, see boardcache.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "boardcache.h"
+#include "sha256.h"
+#include "cache.h"
+
+struct board_cache {
+	uint64_t unique_id;
+	uint32_t jedec_id;
+	uint32_t sectors;
+	uint8_t *known; /* bytes of each hash known, 0 for unknown contents */
+	uint8_t (*hash)[SHA256_SIZE];
+};
+
+/*
+ * The on-flash index, little endian:
+ *
+ *   "ECPX", total length, number of runs
+ *   per run: first sector, sector count, BOARD_INDEX_HASH bytes per sector
+ *   the first BOARD_INDEX_HASH bytes of the SHA-256 of everything before
+ */
+#define INDEX_MAGIC 0x58504345
+#define INDEX_HEADER 12
+
+static void cache_name(char *name, size_t len, const struct board_cache *c)
+{
+	snprintf(name, len, "board-%016" PRIx64 "-%06x.txt", c->unique_id, c->jedec_id);
+}
+
+static int parse_hash(const char *hex, uint8_t *hash)
+{
+	for (int i = 0; i < SHA256_SIZE; i++) {
+		unsigned v;
+		if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+			return -1;
+		hash[i] = v;
+	}
+	return 0;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static struct board_cache *board_cache_new(uint64_t flash_size)
+{
+	struct board_cache *c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	/* Without a known size assume the largest 3-byte addressable flash */
+	if (!flash_size)
+		flash_size = 16 << 20;
+
+	c->sectors = flash_size / BOARD_CACHE_SECTOR;
+	c->known = calloc(c->sectors, sizeof(*c->known));
+	c->hash = calloc(c->sectors, sizeof(*c->hash));
+	if (!c->known || !c->hash) {
+		board_cache_close(c);
+		return NULL;
+	}
+	return c;
+}
+
+struct board_cache *board_cache_open(uint64_t unique_id, uint32_t jedec_id, uint64_t flash_size)
+{
+	struct board_cache *c = board_cache_new(flash_size);
+	if (!c)
+		return NULL;
+
+	c->unique_id = unique_id;
+	c->jedec_id = jedec_id;
+
+	char name[64], line[128];
+	cache_name(name, sizeof(name), c);
+	FILE *f = cache_fopen(name, "r");
+	if (!f)
+		return c;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned sector;
+		char hex[2 * SHA256_SIZE + 1];
+
+		if (sscanf(line, "%x %64s", &sector, hex) != 2 || sector >= c->sectors)
+			continue;
+		if (parse_hash(hex, c->hash[sector]) == 0)
+			c->known[sector] = SHA256_SIZE;
+	}
+	fclose(f);
+
+	return c;
+}
+
+uint32_t board_index_length(const uint8_t *header)
+{
+	if (get32(header) != INDEX_MAGIC || get32(header + 4) < INDEX_HEADER + BOARD_INDEX_HASH)
+		return 0;
+	return get32(header + 4);
+}
+
+bool board_index_valid(const uint8_t *data, uint32_t len)
+{
+	uint8_t hash[SHA256_SIZE];
+	uint32_t total = board_index_length(data);
+	if (!total || total > len)
+		return false;
+	sha256(data, total - BOARD_INDEX_HASH, hash);
+	return !memcmp(hash, data + total - BOARD_INDEX_HASH, BOARD_INDEX_HASH);
+}
+
+struct board_cache *board_cache_import(const uint8_t *data, uint32_t len, uint64_t flash_size)
+{
+	struct board_cache *c = board_cache_new(flash_size);
+	if (!c || !board_index_valid(data, len))
+		return c;
+
+	uint32_t total = board_index_length(data);
+	const uint8_t *p = data + INDEX_HEADER;
+	const uint8_t *end = data + total - BOARD_INDEX_HASH;
+	for (uint32_t runs = get32(data + 8); runs; runs--) {
+		if (end - p < 8)
+			break;
+		uint32_t first = get32(p), count = get32(p + 4);
+		p += 8;
+		if (first >= c->sectors || count > c->sectors - first ||
+		    (uint64_t)(end - p) < (uint64_t)count * BOARD_INDEX_HASH)
+			break;
+
+		for (uint32_t i = 0; i < count; i++, p += BOARD_INDEX_HASH) {
+			memcpy(c->hash[first + i], p, BOARD_INDEX_HASH);
+			c->known[first + i] = BOARD_INDEX_HASH;
+		}
+	}
+	return c;
+}
+
+uint32_t board_cache_export(const struct board_cache *c, uint8_t *data, uint32_t size)
+{
+	uint32_t len = INDEX_HEADER, runs = 0;
+
+	for (uint32_t sector = 0; sector < c->sectors; ) {
+		if (!c->known[sector]) {
+			sector++;
+			continue;
+		}
+
+		uint32_t first = sector;
+		while (sector < c->sectors && c->known[sector])
+			sector++;
+
+		uint32_t count = sector - first;
+		if ((uint64_t)len + 8 + (uint64_t)count * BOARD_INDEX_HASH + BOARD_INDEX_HASH > size)
+			return 0;
+		put32(data + len, first);
+		put32(data + len + 4, count);
+		len += 8;
+		for (uint32_t i = first; i < sector; i++, len += BOARD_INDEX_HASH)
+			memcpy(data + len, c->hash[i], BOARD_INDEX_HASH);
+		runs++;
+	}
+	if (len + BOARD_INDEX_HASH > size)
+		return 0;
+
+	uint8_t hash[SHA256_SIZE];
+	put32(data, INDEX_MAGIC);
+	put32(data + 4, len + BOARD_INDEX_HASH);
+	put32(data + 8, runs);
+	sha256(data, len, hash);
+	memcpy(data + len, hash, BOARD_INDEX_HASH);
+	return len + BOARD_INDEX_HASH;
+}
+
+void board_cache_close(struct board_cache *c)
+{
+	if (!c)
+		return;
+	free(c->known);
+	free(c->hash);
+	free(c);
+}
+
+bool board_cache_match(const struct board_cache *c, uint64_t addr, const uint8_t *data, uint32_t len)
+{
+	uint8_t hash[SHA256_SIZE];
+
+	for (uint32_t i = 0; i < len; i += BOARD_CACHE_SECTOR) {
+		uint64_t sector = (addr + i) / BOARD_CACHE_SECTOR;
+
+		if (sector >= c->sectors || !c->known[sector])
+			return false;
+		sha256(data + i, BOARD_CACHE_SECTOR, hash);
+		if (memcmp(hash, c->hash[sector], c->known[sector]))
+			return false;
+	}
+	return true;
+}
+
+void board_cache_store(struct board_cache *c, uint64_t addr, const uint8_t *data, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i += BOARD_CACHE_SECTOR) {
+		uint64_t sector = (addr + i) / BOARD_CACHE_SECTOR;
+
+		if (sector >= c->sectors)
+			break;
+		sha256(data + i, BOARD_CACHE_SECTOR, c->hash[sector]);
+		c->known[sector] = SHA256_SIZE;
+	}
+}
+
+void board_cache_forget(struct board_cache *c, uint64_t addr, uint64_t len)
+{
+	uint64_t first = addr / BOARD_CACHE_SECTOR;
+	uint64_t last = (addr + len + BOARD_CACHE_SECTOR - 1) / BOARD_CACHE_SECTOR;
+
+	for (uint64_t sector = first; sector < last && sector < c->sectors; sector++)
+		c->known[sector] = 0;
+}
+
+void board_cache_clear(struct board_cache *c)
+{
+	memset(c->known, 0, c->sectors * sizeof(*c->known));
+}
+
+int board_cache_save(const struct board_cache *c)
+{
+	char name[64];
+	cache_name(name, sizeof(name), c);
+	FILE *f = cache_fopen(name, "w");
+	if (!f)
+		return -1;
+
+	for (uint32_t sector = 0; sector < c->sectors; sector++) {
+		if (c->known[sector] != SHA256_SIZE)
+			continue;
+		fprintf(f, "%05x ", sector);
+		for (int i = 0; i < SHA256_SIZE; i++)
+			fprintf(f, "%02x", c->hash[sector][i]);
+		fprintf(f, "\n");
+	}
+	return fclose(f) ? -1 : 0;
+}
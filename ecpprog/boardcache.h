@@ -0,0 +1,69 @@
+/*
+ * Per-board record of the flash contents ecpprog last wrote and verified.
+ *
+ * Boards are identified by the ECP5 unique ID plus the flash JEDEC ID. For
+ * every 4kB sector a SHA-256 of its contents is kept, so reprogramming an
+ * image can skip the sectors that already hold the right data.
+ *
+ * The record can also be kept on the flash itself, as a compact index with
+ * a truncated hash per sector, so it follows the board between hosts.
+ */
+
+#ifndef __BOARDCACHE_H__
+#define __BOARDCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BOARD_CACHE_SECTOR 4096
+
+/* Bytes of each sector hash kept in an on-flash index */
+#define BOARD_INDEX_HASH 8
+
+struct board_cache;
+
+/**
+ * Loads the record for this board, an empty one if there is none yet.
+ * Returns NULL if out of memory.
+ */
+struct board_cache *board_cache_open(uint64_t unique_id, uint32_t jedec_id, uint64_t flash_size);
+void board_cache_close(struct board_cache *c);
+
+/**
+ * True if every sector of [addr, addr + len) is known to hold 'data'.
+ * 'addr' and 'len' must be sector aligned.
+ */
+bool board_cache_match(const struct board_cache *c, uint64_t addr, const uint8_t *data, uint32_t len);
+
+/* Records 'data' as the verified contents of [addr, addr + len) */
+void board_cache_store(struct board_cache *c, uint64_t addr, const uint8_t *data, uint32_t len);
+
+/* Marks [addr, addr + len) as unknown */
+void board_cache_forget(struct board_cache *c, uint64_t addr, uint64_t len);
+
+/* Marks the whole flash as unknown */
+void board_cache_clear(struct board_cache *c);
+
+/* Writes the record back to disk. Returns 0 on success. */
+int board_cache_save(const struct board_cache *c);
+
+/* Length of the on-flash index starting with the 12 bytes at 'header', 0 if
+ * there is none */
+uint32_t board_index_length(const uint8_t *header);
+
+/* True if 'data' holds an intact on-flash index */
+bool board_index_valid(const uint8_t *data, uint32_t len);
+
+/**
+ * Creates a record from the on-flash index in 'data', an empty one if 'data'
+ * holds no intact index. Returns NULL if out of memory.
+ */
+struct board_cache *board_cache_import(const uint8_t *data, uint32_t len, uint64_t flash_size);
+
+/**
+ * Writes the record as an on-flash index to 'data'. Returns its length, or 0
+ * if it needs more than 'size' bytes.
+ */
+uint32_t board_cache_export(const struct board_cache *c, uint8_t *data, uint32_t size);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * SPI bridge access, see bridge.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "jtag.h"
+#include "u2p_stuff.h"
+#include "bridge.h"
+
+/* Commands are collected here and sent as one write-only DR scan */
+#define BRIDGE_QUEUE (64 * 1024)
+
+/* Largest data count per command, so a command always fits the queue */
+#define BRIDGE_CHUNK (BRIDGE_QUEUE / 2)
+
+static uint8_t queue[BRIDGE_QUEUE];
+static uint32_t queued;
+
+/* Free space in the bridge's command buffer, as last reported */
+static uint32_t bridge_free;
+
+/* How long the status may stay the same before the bridge counts as hung */
+static uint32_t timeout_ms = BRIDGE_TIMEOUT_MS;
+
+/* Called once the bridge is hung, see bridge_open() */
+static void (*fail)(int status);
+static bool failed;
+
+/* Waiting for the bridge to make room, fill the read FIFO or go idle */
+struct bridge_wait {
+	uint32_t status;
+	struct timespec deadline;
+};
+
+static uint32_t read_status(void)
+{
+	uint8_t data[4] = { 0 };
+	set_user_ir(BRIDGE_REG_STATUS);
+	rw_user_data(data, 32);
+
+	uint32_t status = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+	bridge_free = status & 0xFFFF;
+	return status;
+}
+
+static void wait_start(struct bridge_wait *w, uint32_t status)
+{
+	w->status = status;
+	clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+	w->deadline.tv_sec += timeout_ms / 1000;
+	w->deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (w->deadline.tv_nsec >= 1000000000L) {
+		w->deadline.tv_sec++;
+		w->deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/* Sleeps before the next status poll. Any change of the status restarts
+ * the deadline; once it passes, the bridge is shut off and 'fail' runs.
+ * Returns false if the wait has to be abandoned. */
+static bool wait_poll(struct bridge_wait *w, uint32_t status)
+{
+	struct timespec now;
+
+	if (status != w->status) {
+		wait_start(w, status);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > w->deadline.tv_sec ||
+		    (now.tv_sec == w->deadline.tv_sec && now.tv_nsec >= w->deadline.tv_nsec)) {
+			fprintf(stderr, "\nSPI bridge stopped responding (status 0x%08X)\n", status);
+			failed = true;
+			queued = 0;
+			fail(EXIT_FAILURE);
+			return false;
+		}
+	}
+	usleep(100);
+	return true;
+}
+
+static void flush(void)
+{
+	uint32_t sent = 0;
+	struct bridge_wait w;
+
+	wait_start(&w, 0);
+	while (sent < queued) {
+		/* Only ask for more room once the last report is used up */
+		if (bridge_free == 0) {
+			if (!wait_poll(&w, read_status()))
+				return;
+			continue;
+		}
+
+		uint32_t n = (queued - sent < bridge_free) ? queued - sent : bridge_free;
+		set_user_ir(BRIDGE_REG_CMD);
+		rw_user_data(NULL, 0);
+		jtag_tap_write(queue + sent, n * 8, true);
+		jtag_go_to_state(STATE_RUN_TEST_IDLE);
+
+		sent += n;
+		bridge_free -= n;
+	}
+	queued = 0;
+}
+
+static void queue_cmd(uint8_t cmd, const uint8_t *data, uint16_t n)
+{
+	if (failed)
+		return;
+	if (queued + 3 + (data ? n : 0) > sizeof(queue))
+		flush();
+
+	queue[queued++] = cmd;
+	queue[queued++] = n;
+	queue[queued++] = n >> 8;
+	if (data) {
+		memcpy(queue + queued, data, n);
+		queued += n;
+	}
+}
+
+/* Collects 'len' bytes from the read FIFO */
+static void drain(uint8_t *data, uint32_t len)
+{
+	struct bridge_wait w;
+
+	flush();
+	wait_start(&w, 0);
+	while (len && !failed) {
+		uint32_t status = read_status();
+		uint32_t avail = (status >> 16) & 0x7FFF;
+		if (!avail) {
+			if (!wait_poll(&w, status))
+				break;
+			continue;
+		}
+
+		uint32_t n = (avail < len) ? avail : len;
+		memset(data, 0, n);
+		set_user_ir(BRIDGE_REG_READ);
+		rw_user_data(data, n * 8);
+
+		data += n;
+		len -= n;
+	}
+	memset(data, 0, len);
+}
+
+int bridge_open(void (*fail_fn)(int status))
+{
+	uint8_t data[4] = { 0 };
+	set_user_ir(BRIDGE_REG_ID);
+	rw_user_data(data, 32);
+
+	uint32_t id = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+	if (id != BRIDGE_ID) {
+		fprintf(stderr, "SPI bridge not found (ID 0x%08X, expected 0x%08X)\n", id, BRIDGE_ID);
+		return -1;
+	}
+
+	queued = 0;
+	bridge_free = 0;
+	timeout_ms = BRIDGE_TIMEOUT_MS;
+	fail = fail_fn;
+	failed = false;
+	return 0;
+}
+
+void bridge_set_timeout(uint32_t ms)
+{
+	timeout_ms = (ms > BRIDGE_TIMEOUT_MS) ? ms : BRIDGE_TIMEOUT_MS;
+}
+
+void bridge_write(const uint8_t *data, uint32_t len, bool hold)
+{
+	while (len) {
+		uint32_t n = (len < BRIDGE_CHUNK) ? len : BRIDGE_CHUNK;
+		queue_cmd(BRIDGE_CMD_WRITE, data, n);
+		data += n;
+		len -= n;
+	}
+	if (!hold)
+		bridge_end();
+}
+
+void bridge_xfer(uint8_t *data, uint32_t len, bool hold)
+{
+	for (uint32_t done = 0; done < len; ) {
+		uint32_t n = (len - done < BRIDGE_CHUNK) ? len - done : BRIDGE_CHUNK;
+		queue_cmd(BRIDGE_CMD_XFER, data + done, n);
+		done += n;
+	}
+	if (!hold)
+		bridge_end();
+	drain(data, len);
+}
+
+void bridge_read(uint8_t *data, uint32_t len, bool hold)
+{
+	for (uint32_t done = 0; done < len; ) {
+		uint32_t n = (len - done < BRIDGE_CHUNK) ? len - done : BRIDGE_CHUNK;
+		queue_cmd(BRIDGE_CMD_READ, NULL, n);
+		done += n;
+	}
+	if (!hold)
+		bridge_end();
+	drain(data, len);
+}
+
+void bridge_end(void)
+{
+	queue_cmd(BRIDGE_CMD_END, NULL, 0);
+}
+
+void bridge_wait(void)
+{
+	queue_cmd(BRIDGE_CMD_WAIT, NULL, 0);
+}
+
+void bridge_sync(void)
+{
+	struct bridge_wait w;
+
+	flush();
+	wait_start(&w, 0);
+	while (!failed) {
+		uint32_t status = read_status();
+		if ((status & (1u << 31)) || !wait_poll(&w, status))
+			break;
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * Flash access through an SPI bridge design loaded into the FPGA's SRAM.
+ *
+ * In SPI background mode every SPI clock is a TCK and every status poll is a
+ * USB round trip. A bridge design instead runs the SPI bus from its own
+ * clock and polls the busy flag itself, so erase and program commands can be
+ * queued in bulk.
+ *
+ * The bridge is accessed like the u2p debug block (u2p_stuff.c): USER1
+ * selects one of its registers, USER2 then shifts it, bytes LSB first.
+ *
+ *   BRIDGE_REG_ID      32 bits, reads BRIDGE_ID
+ *   BRIDGE_REG_CMD     write-only command stream, see below
+ *   BRIDGE_REG_STATUS  32 bits: [15:0] free bytes in the command buffer,
+ *                      [30:16] bytes waiting in the read FIFO,
+ *                      [31] idle (command buffer empty, CS high)
+ *   BRIDGE_REG_READ    shifts bytes out of the read FIFO
+ *
+ * Each command is an opcode byte and a 16-bit little-endian count n:
+ *
+ *   BRIDGE_CMD_WRITE   n bytes follow, sent on MOSI
+ *   BRIDGE_CMD_XFER    n bytes follow, sent on MOSI, MISO goes to the read FIFO
+ *   BRIDGE_CMD_READ    n bytes are clocked in from MISO into the read FIFO,
+ *                      stalling while the FIFO is full
+ *   BRIDGE_CMD_END     raises CS, n = 0
+ *   BRIDGE_CMD_WAIT    polls status register 1 until WIP is clear, n = 0
+ *
+ * CS goes low with the first WRITE, XFER or READ after END or WAIT.
+ * The command stream may be split over DR scans at any byte.
+ */
+
+#ifndef __BRIDGE_H__
+#define __BRIDGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BRIDGE_ID 0x53504942 /* "SPIB" */
+
+/* The shortest time the bridge may go without a change of its status
+ * before it counts as hung, see bridge_set_timeout() */
+#define BRIDGE_TIMEOUT_MS 3000
+
+enum bridge_reg {
+	BRIDGE_REG_ID = 0,
+	BRIDGE_REG_CMD = 1,
+	BRIDGE_REG_STATUS = 2,
+	BRIDGE_REG_READ = 3,
+};
+
+enum bridge_cmd {
+	BRIDGE_CMD_WRITE = 0x01,
+	BRIDGE_CMD_XFER = 0x02,
+	BRIDGE_CMD_READ = 0x03,
+	BRIDGE_CMD_END = 0x04,
+	BRIDGE_CMD_WAIT = 0x05,
+};
+
+/* Checks that the bridge design is running. Returns 0 on success. If the
+ * bridge later hangs, it is shut off (further calls do nothing and reads
+ * return zeros) and 'fail' is called with EXIT_FAILURE. */
+int bridge_open(void (*fail)(int status));
+
+/* Raises the timeout to 'ms', the longest a queued command can keep the
+ * bridge busy, such as the flash's slowest erase */
+void bridge_set_timeout(uint32_t ms);
+
+/* Sends 'len' bytes, keeping CS low afterwards if 'hold' */
+void bridge_write(const uint8_t *data, uint32_t len, bool hold);
+
+/* Sends 'len' bytes and returns what the flash sent meanwhile in 'data' */
+void bridge_xfer(uint8_t *data, uint32_t len, bool hold);
+
+/* Reads 'len' bytes, keeping CS low afterwards if 'hold' */
+void bridge_read(uint8_t *data, uint32_t len, bool hold);
+
+/* Raises CS */
+void bridge_end(void);
+
+/* Queues a wait for the flash to finish a program or erase */
+void bridge_wait(void);
+
+/* Sends all queued commands and waits until the bridge has executed them */
+void bridge_sync(void);
+
+#endif
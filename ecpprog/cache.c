@@ -0,0 +1,79 @@
+/*
+ * On-disk cache location, see cache.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h> /* _mkdir() */
+#endif
+
+#include "cache.h"
+
+static int make_dir(const char *path)
+{
+#ifdef _WIN32
+	int rc = _mkdir(path);
+#else
+	int rc = mkdir(path, 0755);
+#endif
+	return (rc == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+static int cache_dir(char *path, size_t len, int create)
+{
+	const char *dir = getenv("ECPPROG_CACHE_DIR");
+	if (dir && *dir) {
+		snprintf(path, len, "%s", dir);
+		return (create && make_dir(path)) ? -1 : 0;
+	}
+
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *sub = "ecpprog";
+	char parent[900];
+
+	if (base && *base) {
+		snprintf(parent, sizeof(parent), "%s", base);
+	} else if ((base = getenv("HOME")) && *base) {
+		snprintf(parent, sizeof(parent), "%s/.cache", base);
+	} else if ((base = getenv("LOCALAPPDATA")) && *base) {
+		snprintf(parent, sizeof(parent), "%s", base);
+	} else {
+		return -1;
+	}
+
+	snprintf(path, len, "%s/%s", parent, sub);
+	if (create && (make_dir(parent) || make_dir(path)))
+		return -1;
+	return 0;
+}
+
+FILE *cache_fopen(const char *name, const char *mode)
+{
+	char dir[1024];
+	char path[1280];
+	int create = (mode[0] == 'w' || mode[0] == 'a');
+
+	if (cache_dir(dir, sizeof(dir), create))
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return fopen(path, mode);
+}
+
+int cache_remove(const char *name)
+{
+	char dir[1024];
+	char path[1280];
+
+	if (cache_dir(dir, sizeof(dir), 0))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return remove(path);
+}
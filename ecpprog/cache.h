@@ -0,0 +1,22 @@
+/*
+ * Location of ecpprog's on-disk cache.
+ *
+ * Files live in $ECPPROG_CACHE_DIR if set, otherwise in $XDG_CACHE_HOME/ecpprog,
+ * ~/.cache/ecpprog or %LOCALAPPDATA%\ecpprog.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+
+/**
+ * Opens 'name' inside the cache directory, creating the directory when
+ * opening for writing. Returns NULL if the file or directory is unavailable.
+ */
+FILE *cache_fopen(const char *name, const char *mode);
+
+/* Deletes 'name' from the cache directory. Returns 0 on success. */
+int cache_remove(const char *name);
+
+#endif
@@ -31,6 +31,7 @@
 #define ECP_UNIQUE_ID 0x24 // void
 #define ECP_CLEARFPGA 0x25 // void
 #define DAEMON_ID 0x41 // This is like an inquiry to see if the daemon is running.
+#define DAEMON_PROGRESS_EVENTS 0x42 // void, since version 2: send CODE_PROGRESS_EVENT instead of CODE_PROGRESS
 #define SYNC_BYTE 0xCC
 #define CODE_OKAY 0x00
 #define CODE_BAD_SYNC 0xEE
@@ -40,17 +41,40 @@
 #define CODE_VERIFY_ERROR 0xEA
 #define CODE_FIFO_ERROR 0xE9
 #define CODE_PROGRESS 0xBF
+#define CODE_PROGRESS_EVENT 0xBE
 
 int clientfd;
-unsigned int pagediv;
+static bool progress_events;    // the client asked for DAEMON_PROGRESS_EVENTS
+static uint64_t progress_pages; // bytes programmed up to the last CODE_PROGRESS
 
-void progress(void)
+static void put_le64(uint8_t *p, uint64_t value)
 {
-    pagediv ++;
-    if (pagediv >= 4) {
+    for (int i = 0; i < 8; i++)
+        p[i] = value >> (8 * i);
+}
+
+// With DAEMON_PROGRESS_EVENTS:
+//   CODE_PROGRESS_EVENT, ECP_PROGFLASH, phase, 1 on the last event of the phase,
+//   bytes done (uint64_t, little endian), bytes total (uint64_t, little endian, 0 if unknown)
+// Otherwise, as before: CODE_PROGRESS, ECP_PROGFLASH every 4 pages programmed
+void progress(const struct progress *p)
+{
+    if (progress_events) {
+        uint8_t update[20] = { CODE_PROGRESS_EVENT, ECP_PROGFLASH, p->phase, p->end };
+        put_le64(update + 4, p->done);
+        put_le64(update + 12, p->total);
+        send(clientfd, update, 20, 0);
+        return;
+    }
+
+    if (p->phase != PROGRESS_PROGRAM)
+        return;
+    if (p->done < progress_pages)
+        progress_pages = 0;
+    while (p->done >= progress_pages + 4 * 256) {
         uint8_t update[2] = { CODE_PROGRESS, ECP_PROGFLASH };
-        send(clientfd, update, 2, 0);    
-        pagediv = 0;
+        send(clientfd, update, 2, 0);
+        progress_pages += 4 * 256;
     }
 }
 
@@ -59,6 +83,8 @@ int start_daemon(int portnr)
 	int lSocket;
 	struct sockaddr_in sLocalAddr;
 
+	progress_listen(progress);
+
 	lSocket = socket(AF_INET, SOCK_STREAM, 0);
 	if (lSocket < 0) {
 		puts("lSocket < 0");
@@ -108,6 +134,8 @@ int start_daemon(int portnr)
 		clientfd = accept(lSocket, (struct sockaddr*)&client_addr, (socklen_t *)&addrlen);
 		if (clientfd > 0) {
 			puts("Accepted Connection");
+			progress_events = false;
+			progress_pages = 0;
 
             while(1) {
                 printf("Waiting for command... ");
@@ -132,11 +160,16 @@ int start_daemon(int portnr)
                 uint8_t err = 0;
                 switch(buffer[1]) {
                     case DAEMON_ID:
-                        buffer[2] = 0x01; // version
+                        buffer[2] = 0x02; // version
                         buffer[3] = 0x00;
                         buffer[0] = CODE_OKAY;
                         send(clientfd, buffer, 4, 0);
                         break;
+                    case DAEMON_PROGRESS_EVENTS:
+                        progress_events = true;
+                        buffer[0] = CODE_OKAY;
+                        send(clientfd, buffer, 2, 0);
+                        break;
                     case USER_READ_ID:
                         pul = (uint32_t *)(buffer+4);
                         *pul = user_read_id();
@@ -370,14 +403,16 @@ int start_daemon(int portnr)
                             buffer[0] = CODE_OKAY;
 
                             if(buffer[1] == ECP_LOADFPGA) {
-                                ecp_prog_sram(f, false);
+                                if (ecp_prog_sram(f, false)) {
+                                    buffer[0] = CODE_VERIFY_ERROR;
+                                }
                             } else {
                                 ecp_init_flash_mode();
-                                pagediv = 0;
-                                ecp_prog_flash(f, true, false, false, false, 64, (int)addr, &progress);
-                                if (ecp_flash_verify(f, (int)addr)) {
+                                ecp_prog_flash(f, true, false, false, false, 64, addr);
+                                if (ecp_flash_verify(f, addr)) {
                                     buffer[0] = CODE_VERIFY_ERROR;
                                 }
+                                ecp_exit_flash_mode();
                             }
                             fclose(f);
                             send(clientfd, buffer, 2, 0);
@@ -0,0 +1,338 @@
+/*
+ * Streaming decompression, see decompress.h
+ *
+ *  Relevant Documents:
+ *  -------------------
+ *  RFC 1952, GZIP file format specification
+ *  RFC 8878, Zstandard Compression and the application/zstd Media Type
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <io.h>    /* _pipe() */
+#include <fcntl.h> /* _O_BINARY */
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+
+#define CHUNK (64 * 1024)
+#define ZSTD_HEADER_MAX 18
+
+enum format {
+	FORMAT_GZIP,
+	FORMAT_ZSTD,
+};
+
+struct decompress {
+	FILE *in;
+	enum format format;
+	uint8_t prefix[ZSTD_HEADER_MAX]; /* input read before the decoder started */
+	size_t prefix_len;
+
+	int fd;            /* write end of the pipe, owned by the thread */
+	FILE *out;         /* read end */
+	pthread_t thread;
+
+	long size_hint;
+	long produced;
+	int status;
+};
+
+static const uint8_t gzip_magic[] = { 0x1F, 0x8B };
+static const uint8_t zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+static bool match(const uint8_t *data, size_t len, const uint8_t *magic, size_t magic_len)
+{
+	return !memcmp(data, magic, (len < magic_len) ? len : magic_len);
+}
+
+bool decompress_detect(const uint8_t *magic, size_t len)
+{
+	return len && (match(magic, len, gzip_magic, sizeof(gzip_magic)) ||
+	               match(magic, len, zstd_magic, sizeof(zstd_magic)));
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Compressed input, starting with the prefix */
+static size_t read_input(struct decompress *d, uint8_t *buffer, size_t len)
+{
+	size_t n = 0;
+
+	if (d->prefix_len) {
+		n = (d->prefix_len < len) ? d->prefix_len : len;
+		memcpy(buffer, d->prefix, n);
+		memmove(d->prefix, d->prefix + n, d->prefix_len - n);
+		d->prefix_len -= n;
+	}
+	return n + fread(buffer + n, 1, len - n, d->in);
+}
+
+static int write_output(struct decompress *d, const uint8_t *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(d->fd, data, len);
+		if (n <= 0)
+			return -1;
+		data += n;
+		len -= n;
+		d->produced += n;
+	}
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static int inflate_gzip(struct decompress *d, uint8_t *in, uint8_t *out)
+{
+	z_stream z;
+	int rc = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, 15 + 16) != Z_OK)
+		return -1;
+
+	while (true) {
+		if (z.avail_in == 0) {
+			z.next_in = in;
+			z.avail_in = read_input(d, in, CHUNK);
+			if (z.avail_in == 0)
+				break;
+		}
+
+		z.next_out = out;
+		z.avail_out = CHUNK;
+		rc = inflate(&z, Z_NO_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END)
+			break;
+		if (write_output(d, out, CHUNK - z.avail_out)) {
+			rc = Z_STREAM_ERROR;
+			break;
+		}
+
+		/* Concatenated gzip members decompress to concatenated data */
+		if (rc == Z_STREAM_END && inflateReset(&z) != Z_OK)
+			break;
+	}
+
+	inflateEnd(&z);
+	return (rc == Z_STREAM_END) ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int inflate_zstd(struct decompress *d, uint8_t *in, uint8_t *out)
+{
+	ZSTD_DStream *z = ZSTD_createDStream();
+	ZSTD_inBuffer input = { in, 0, 0 };
+	size_t rc = 1;
+
+	if (!z)
+		return -1;
+	ZSTD_initDStream(z);
+
+	while (true) {
+		if (input.pos == input.size) {
+			input.size = read_input(d, in, CHUNK);
+			input.pos = 0;
+			if (input.size == 0)
+				break;
+		}
+
+		ZSTD_outBuffer output = { out, CHUNK, 0 };
+		rc = ZSTD_decompressStream(z, &output, &input);
+		if (ZSTD_isError(rc) || write_output(d, out, output.pos)) {
+			rc = 1;
+			break;
+		}
+	}
+
+	ZSTD_freeDStream(z);
+	/* 0 means the last frame was complete */
+	return (rc == 0) ? 0 : -1;
+}
+#endif
+
+static void *decompress_thread(void *arg)
+{
+	struct decompress *d = arg;
+	uint8_t *in = malloc(CHUNK);
+	uint8_t *out = malloc(CHUNK);
+
+	d->status = -1;
+	if (in && out) {
+		switch (d->format) {
+		case FORMAT_GZIP:
+#ifdef HAVE_ZLIB
+			d->status = inflate_gzip(d, in, out);
+#endif
+			break;
+		case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+			d->status = inflate_zstd(d, in, out);
+#endif
+			break;
+		}
+	}
+
+	free(in);
+	free(out);
+	close(d->fd);
+	return NULL;
+}
+
+static long size_hint(struct decompress *d)
+{
+	if (d->format == FORMAT_ZSTD) {
+		/* The frame header follows the magic, keep it in the prefix */
+		uint8_t *header = d->prefix;
+		d->prefix_len += fread(d->prefix + d->prefix_len, 1, sizeof(d->prefix) - d->prefix_len, d->in);
+		size_t n = d->prefix_len;
+		if (n < 6)
+			return -1;
+
+		/* Frame_Header_Descriptor: FCS size, single segment and dictionary ID flags */
+		uint8_t fhd = header[4];
+		int fcs_size = (int[]){ 0, 2, 4, 8 }[fhd >> 6];
+		bool single = fhd & 0x20;
+		int did_size = (int[]){ 0, 1, 2, 4 }[fhd & 3];
+		int pos = 5 + (single ? 0 : 1) + did_size;
+
+		if (fcs_size == 0 && single)
+			fcs_size = 1;
+		if (fcs_size == 0 || (size_t)(pos + fcs_size) > n)
+			return -1;
+
+		uint64_t fcs = 0;
+		for (int i = fcs_size - 1; i >= 0; i--)
+			fcs = (fcs << 8) | header[pos + i];
+		if (fcs_size == 2)
+			fcs += 256;
+		return (long)fcs;
+	}
+
+	/* ISIZE, the last four bytes of a gzip file */
+	long pos = ftell(d->in);
+	uint8_t isize[4];
+	long hint = -1;
+
+	if (pos >= 0 && fseek(d->in, -4, SEEK_END) == 0 && fread(isize, 1, 4, d->in) == 4) {
+		long compressed = ftell(d->in);
+		hint = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((long)isize[3] << 24);
+		/* Deflate can't do better than 1032:1, so a truncated file
+		   most likely ends in something that isn't an ISIZE */
+		if (hint / 1032 > compressed)
+			hint = -1;
+	}
+	if (pos >= 0)
+		fseek(d->in, pos, SEEK_SET);
+	return hint;
+}
+
+struct decompress *decompress_open(FILE *in, const uint8_t *prefix, size_t prefix_len)
+{
+	uint8_t magic[DECOMPRESS_MAGIC_LEN];
+	int fd[2];
+
+	struct decompress *d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->in = in;
+
+	if (!prefix) {
+		prefix_len = fread(magic, 1, sizeof(magic), in);
+		prefix = magic;
+	}
+	if (prefix_len > sizeof(d->prefix))
+		prefix_len = sizeof(d->prefix);
+	memcpy(d->prefix, prefix, prefix_len);
+	d->prefix_len = prefix_len;
+
+	if (prefix_len >= sizeof(zstd_magic) && !memcmp(prefix, zstd_magic, sizeof(zstd_magic)))
+		d->format = FORMAT_ZSTD;
+	else if (prefix_len >= sizeof(gzip_magic) && !memcmp(prefix, gzip_magic, sizeof(gzip_magic)))
+		d->format = FORMAT_GZIP;
+	else
+		goto error;
+
+#ifndef HAVE_ZLIB
+	if (d->format == FORMAT_GZIP) {
+		fprintf(stderr, "ecpprog was built without gzip support\n");
+		goto error;
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (d->format == FORMAT_ZSTD) {
+		fprintf(stderr, "ecpprog was built without zstd support\n");
+		goto error;
+	}
+#endif
+
+	d->size_hint = size_hint(d);
+
+#ifdef _WIN32
+	if (_pipe(fd, CHUNK, _O_BINARY))
+		goto error;
+#else
+	/* A reader that gives up early must not kill us with SIGPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(fd))
+		goto error;
+#endif
+
+	d->fd = fd[1];
+	d->out = fdopen(fd[0], "rb");
+	if (!d->out) {
+		close(fd[0]);
+		close(fd[1]);
+		goto error;
+	}
+
+	if (pthread_create(&d->thread, NULL, decompress_thread, d)) {
+		fclose(d->out);
+		close(fd[1]);
+		goto error;
+	}
+	return d;
+
+error:
+	free(d);
+	return NULL;
+}
+
+FILE *decompress_stream(struct decompress *d)
+{
+	return d->out;
+}
+
+long decompress_size_hint(const struct decompress *d)
+{
+	return d->size_hint;
+}
+
+long decompress_close(struct decompress *d)
+{
+	/* Unblocks the decoder if the reader stopped early */
+	fclose(d->out);
+	pthread_join(d->thread, NULL);
+
+	long produced = d->status ? -1 : d->produced;
+	free(d);
+	return produced;
+}
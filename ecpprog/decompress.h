@@ -0,0 +1,47 @@
+/*
+ * Streaming decompression of gzip and zstd compressed input.
+ *
+ * The decoder runs on its own thread and feeds a pipe, so the rest of
+ * ecpprog reads the decompressed image from an ordinary FILE. Support for
+ * each format is compiled in when its library is found (HAVE_ZLIB, HAVE_ZSTD).
+ */
+
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DECOMPRESS_MAGIC_LEN 4
+
+struct decompress;
+
+/* True if 'magic' (the first bytes of a file) looks gzip or zstd compressed.
+   Fewer bytes than DECOMPRESS_MAGIC_LEN give a preliminary answer. */
+bool decompress_detect(const uint8_t *magic, size_t len);
+
+/**
+ * Starts decompressing 'in'. 'prefix' holds bytes already read from 'in'
+ * (for example to detect the format), NULL when reading from the start.
+ * 'in' stays owned by the caller and must stay open until decompress_close().
+ * Returns NULL on errors.
+ */
+struct decompress *decompress_open(FILE *in, const uint8_t *prefix, size_t prefix_len);
+
+/* The decompressed data */
+FILE *decompress_stream(struct decompress *d);
+
+/**
+ * Decompressed size as recorded by the compressor: the zstd frame header,
+ * or the gzip trailer if 'in' is seekable. -1 if unknown.
+ */
+long decompress_size_hint(const struct decompress *d);
+
+/**
+ * Closes the stream and stops the decoder. Returns the number of bytes
+ * decompressed, or -1 if the input was corrupt or truncated.
+ */
+long decompress_close(struct decompress *d);
+
+#endif
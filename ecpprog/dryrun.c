@@ -0,0 +1,250 @@
+/*
+ * Cost model for --dry-run, see dryrun.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "dryrun.h"
+#include "mpsse.h"
+#include "sfdp.h"
+
+/* The latency timer is set to 1 ms, replies shorter than a USB packet
+ * wait for it to expire: half of it on average */
+#define ROUND_TRIP_US 500
+
+/* A write the host waits for completes in the next high-speed microframe */
+#define USB_WRITE_US 125
+
+/* Bulk throughput of a high-speed FTDI */
+#define USB_BYTES_PER_S 30000000.0
+
+/* Page program time of a common 128 Mbit part, for flash without SFDP timing */
+#define PAGE_US 700
+
+enum {
+	SETUP = PROGRESS_READ + 1,
+	PHASES
+};
+
+static const char *phase_names[PHASES] = {
+	[SETUP] = "setup",
+	[PROGRESS_ERASE] = "erase",
+	[PROGRESS_PROGRAM] = "program",
+	[PROGRESS_VERIFY] = "verify",
+	[PROGRESS_READ] = "read",
+};
+
+struct cost {
+	uint64_t bytes;       /* reported by the phase */
+	uint64_t usb_out;
+	uint64_t usb_in;
+	uint64_t round_trips;
+	double wire;          /* seconds shifting TCK or moving USB bytes */
+	double wait;          /* seconds of USB latency */
+	double busy;          /* seconds sleeping while the flash works */
+};
+
+bool dryrun_active;
+
+static struct cost costs[PHASES];
+static int phase = SETUP;
+static double tck_hz;
+static double now, phase_start;
+
+/* TCK cycles of a buffer of complete MPSSE commands */
+static uint64_t clock_cycles(const uint8_t *tx, uint32_t len)
+{
+	uint64_t cycles = 0;
+
+	for (uint32_t i = 0; i + 1 < len; ) {
+		uint8_t cmd = tx[i];
+
+		if (cmd == MC_CLK_N) {
+			cycles += tx[i + 1] + 1;
+			i += 2;
+		} else if (cmd == MC_CLK_N8 && i + 2 < len) {
+			cycles += 8 * ((tx[i + 1] | tx[i + 2] << 8) + 1);
+			i += 3;
+		} else if (cmd & 0x80) {
+			/* Setup commands, only clock divider and pins take arguments */
+			i += (cmd == MC_SETB_LOW || cmd == MC_SETB_HIGH || cmd == MC_SET_CLK_DIV) ? 3 : 1;
+		} else if (cmd & MC_DATA_BITS) {
+			cycles += tx[i + 1] + 1;
+			i += (cmd & (MC_DATA_OUT | MC_DATA_TMS)) ? 3 : 2;
+		} else if (i + 2 < len) {
+			uint32_t n = (tx[i + 1] | tx[i + 2] << 8) + 1;
+			cycles += 8 * n;
+			i += 3 + ((cmd & MC_DATA_OUT) ? n : 0);
+		} else {
+			break;
+		}
+	}
+	return cycles;
+}
+
+/* One USB transfer: 'out' bytes of MPSSE commands from 'tx', then 'in'
+ * bytes into 'rx'. 'sync' if the host waits for a write to complete. */
+static void usb(const uint8_t *tx, uint32_t out, uint8_t *rx, uint32_t in, bool sync)
+{
+	struct cost *c = &costs[phase];
+	double shift = clock_cycles(tx, out) / tck_hz;
+	double usb = (out + in) / USB_BYTES_PER_S;
+	double wire = shift > usb ? shift : usb;
+	double wait = in ? ROUND_TRIP_US * 1e-6 : sync ? USB_WRITE_US * 1e-6 : 0;
+
+	c->usb_out += out;
+	c->usb_in += in;
+	c->wire += wire;
+	c->wait += wait;
+	if (in) {
+		c->round_trips++;
+		memset(rx, 0, in);
+	}
+	now += wire + wait;
+}
+
+static void model_init(int ifnum, const char *devstr, int clkdiv)
+{
+}
+
+/* There is no device to open, release or flush */
+static void model_none(void)
+{
+}
+
+static uint8_t model_recv_byte(void)
+{
+	uint8_t data;
+	usb(NULL, 0, &data, 1, false);
+	return data;
+}
+
+static void model_send_byte(uint8_t data)
+{
+	usb(&data, 1, NULL, 0, true);
+}
+
+static void model_xfer(uint8_t *data_buffer, uint16_t send_length, uint16_t receive_length)
+{
+	usb(data_buffer, send_length, data_buffer, receive_length, true);
+}
+
+static void model_xfer_stream(uint8_t *tx_buffer, uint32_t send_length, uint8_t *rx_buffer, uint32_t receive_length)
+{
+	usb(tx_buffer, send_length, rx_buffer, receive_length, true);
+}
+
+static void model_write_stream(uint8_t *tx_buffer, uint32_t send_length)
+{
+	usb(tx_buffer, send_length, NULL, 0, false);
+}
+
+/* The host sleeps while the flash works */
+static void model_sleep(uint32_t us)
+{
+	costs[phase].busy += us * 1e-6;
+	now += us * 1e-6;
+}
+
+static const struct mpsse_backend model = {
+	.init = model_init,
+	.close = model_none,
+	.abort = model_none,
+	.recv_byte = model_recv_byte,
+	.send_byte = model_send_byte,
+	.xfer = model_xfer,
+	.xfer_stream = model_xfer_stream,
+	.write_stream = model_write_stream,
+	.write_flush = model_none,
+	.sleep = model_sleep,
+};
+
+void dryrun_start(int clkdiv)
+{
+	tck_hz = MPSSE_TCK_HZ(clkdiv);
+	dryrun_active = true;
+	mpsse_set_backend(&model);
+}
+
+/* Typical time of erasing 'size' bytes, a block or the whole chip */
+static uint32_t erase_ms(uint64_t size)
+{
+	if (size <= (4 << 10))
+		return 45;
+	if (size <= (32 << 10))
+		return 120;
+	if (size <= (64 << 10))
+		return 150;
+
+	/* Chip erase, 40 s for 16 MB */
+	return size * 40000 / (16 << 20);
+}
+
+void dryrun_flash_times(struct flash_info *info)
+{
+	if (!info->page_typ_us)
+		info->page_typ_us = PAGE_US;
+	if (!info->chip_typ_ms)
+		info->chip_typ_ms = erase_ms(info->size ? info->size : 16 << 20);
+
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+		struct flash_erase_type *et = &info->erase[i];
+		if (et->size && !et->typ_ms)
+			et->typ_ms = erase_ms(et->size);
+	}
+}
+
+void dryrun_progress(const struct progress *p)
+{
+	if (!p->end) {
+		if (phase == SETUP)
+			phase_start = now;
+		phase = p->phase;
+		return;
+	}
+
+	costs[p->phase].bytes += p->done;
+	phase = SETUP;
+	fprintf(stderr, "\r\033[0K%-15s%04" PRIu64 "  %.1f s estimated", p->label, p->done, now - phase_start);
+}
+
+static void print_cost(const char *name, const struct cost *c)
+{
+	printf("%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %8" PRIu64 " %9.3f %9.3f %9.3f %9.3f\n",
+		name, c->bytes, c->usb_out, c->usb_in, c->round_trips,
+		c->wire, c->wait, c->busy, c->wire + c->wait + c->busy);
+}
+
+void dryrun_print(void)
+{
+	struct cost total = {0};
+
+	printf("estimate at %.3f MHz TCK, %d us per round trip, %d us per USB write\n",
+		tck_hz / 1e6, ROUND_TRIP_US, USB_WRITE_US);
+	printf("%-8s %10s %10s %10s %8s %9s %9s %9s %9s\n",
+		"phase", "bytes", "USB out", "USB in", "trips", "wire s", "wait s", "flash s", "total s");
+
+	for (int i = 0; i < PHASES; i++) {
+		/* Setup first, then the phases in the order they run */
+		int p = (i + SETUP) % PHASES;
+		const struct cost *c = &costs[p];
+		if (!c->usb_out && !c->busy)
+			continue;
+
+		print_cost(phase_names[p], c);
+		total.bytes += c->bytes;
+		total.usb_out += c->usb_out;
+		total.usb_in += c->usb_in;
+		total.round_trips += c->round_trips;
+		total.wire += c->wire;
+		total.wait += c->wait;
+		total.busy += c->busy;
+	}
+	print_cost("total", &total);
+}
@@ -0,0 +1,39 @@
+/*
+ * Cost model behind --dry-run
+ *
+ * dryrun_start() puts the model in place of the FTDI adapter behind the
+ * MPSSE layer, so the normal erase, program and verify code plans the run
+ * without hardware. Reads return zeros. Each transfer costs the TCK cycles
+ * of its MPSSE commands or its USB bytes, whichever takes longer, plus a
+ * fixed latency when the host waits for the adapter. The modeled flash is
+ * never busy when polled: it completes each operation in the typical time
+ * the host sleeps before the first poll, from SFDP or from a common 128
+ * Mbit part.
+ *
+ * Costs add up per progress phase; everything outside one counts as setup.
+ */
+
+#ifndef __DRYRUN_H__
+#define __DRYRUN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "progress.h"
+#include "sfdp.h"
+
+extern bool dryrun_active;
+
+/* Replaces the adapter by the model, at the TCK set by 'clkdiv' */
+void dryrun_start(int clkdiv);
+
+/* Fills in the typical times 'info' lacks with those of the modeled part */
+void dryrun_flash_times(struct flash_info *info);
+
+/* Progress listener attributing costs to phases */
+void dryrun_progress(const struct progress *p);
+
+/* Writes the estimate per phase to stdout */
+void dryrun_print(void);
+
+#endif
@@ -28,11 +28,13 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -43,10 +45,27 @@
 #endif
 
 #include "jtag.h"
+#include "mpsse.h"
 #include "lattice_cmds.h"
 #include "ecpprog.h"
 #include "u2p_stuff.h"
 #include "daemon.h"
+#include "pipeline.h"
+#include "sfdp.h"
+#include "boardcache.h"
+#include "sha256.h"
+#include "sparse.h"
+#include "image.h"
+#include "decompress.h"
+#include "bitstream.h"
+#include "watch.h"
+#include "progress.h"
+#include "report.h"
+#include "trace.h"
+#include "bridge.h"
+#include "journal.h"
+#include "slot.h"
+#include "dryrun.h"
 
 static bool verbose = false;
 
@@ -64,6 +83,74 @@ struct device_info {
 
 static struct device_info connected_device = {0};
 
+/* Geometry and timing of the SPI flash, from SFDP when available */
+static struct flash_info flash;
+
+/* Flashes above 16 MB need 4-byte addresses, either through dedicated
+ * opcodes or by switching the flash to 4-byte mode with EN4B */
+static int flash_addr_len = 3;
+static bool flash_4b_opcodes = false;
+static bool flash_4b_mode = false;
+
+/* With --bridge, the flash is reached through a bridge design loaded into
+ * SRAM instead of SPI background mode, see bridge.h */
+static const char *bridge_path = NULL;
+static bool bridge_active = false;
+
+/* Record of what was last verified on this board, see boardcache.h */
+static bool board_cache_enabled = false;
+static int board_spot_checks = 0;
+static uint64_t board_unique_id;
+static struct board_cache *board_cache;
+
+/* With --flash-index, the board cache is kept in a region of the flash
+ * itself instead of on the host */
+#define FLASH_INDEX_SIZE (64 * 1024)
+static bool flash_index = false;
+static uint64_t flash_index_addr;
+static uint8_t *flash_index_data; /* the index the region holds */
+static uint32_t flash_index_len;  /* 0 if it holds none */
+static uint32_t flash_index_erased; /* bytes at its start known to be erased */
+
+/* With --slots, images go to the slot that isn't booted and the header
+ * sector is switched over once they verify, see slot.h */
+static bool slots_enabled = false;
+static uint32_t slot_addr[2];
+static struct slot_header slot_header;
+
+/* With --repair, verify reads on past mismatches and up to this many rounds
+ * of re-erasing and reprogramming just the sectors that differ follow */
+static int repair_rounds = 0;
+
+/* Progress of the current programming run, see journal.h */
+static bool journal_resume = false;
+static struct journal *journal;
+
+/* With --report, the timing report is written here at exit (stdout if NULL) */
+static bool report_enabled = false;
+static const char *report_path = NULL;
+static struct report_info report_info;
+
+/* With --dry-run, the JEDEC ID of the flash to model (0 for the defaults) */
+static uint32_t dry_run_jedec_id;
+
+/* Compare the device's frame CRC with the bitstream after SRAM programming */
+static bool sram_crc_check = false;
+
+/* Erase blocks ecp_prog_flash() left alone because the board cache shows
+ * they already hold the image; verification skips them as well. With
+ * --in-place, blocks whose update only clears bits are programmed without
+ * an erase, skipping the pages that already match. */
+static bool in_place_enabled = false;
+static struct {
+	uint64_t begin;
+	uint32_t block_size;
+	uint32_t blocks;
+	bool *unchanged;
+	bool *in_place;
+	bool *page_same;
+} prog_plan;
+
 
 // ---------------------------------------------------------
 // FLASH definitions
@@ -108,6 +195,10 @@ enum flash_cmd {
 	FC_QPI = 0x38, /* Enter QPI mode */
 	FC_ERESET = 0x66, /* Enable Reset */
 	FC_RESET = 0x99, /* Reset Device */
+	FC_EN4B = 0xB7, /* Enter 4-Byte Address Mode */
+	FC_EX4B = 0xE9, /* Exit 4-Byte Address Mode */
+	FC_RD4B = 0x13, /* Read Data with 4-Byte Address */
+	FC_PP4B = 0x12, /* Page Program with 4-Byte Address */
 };
 
 
@@ -119,21 +210,24 @@ enum flash_cmd {
  * JTAG performrs all shifts LSB first, our FLSAH is expeting bytes MSB first,
  * There are a few ways to fix this, for now we just bit-reverse all the input data to the JTAG core
  */
-uint8_t bit_reverse(uint8_t in){
+#define R2(n) (n), (n) + 2 * 64, (n) + 1 * 64, (n) + 3 * 64
+#define R4(n) R2(n), R2((n) + 2 * 16), R2((n) + 1 * 16), R2((n) + 3 * 16)
+#define R6(n) R4(n), R4((n) + 2 * 4), R4((n) + 1 * 4), R4((n) + 3 * 4)
+static const uint8_t bit_reverse_table[256] = { R6(0), R6(2), R6(1), R6(3) };
+#undef R2
+#undef R4
+#undef R6
 
-	uint8_t out =  (in & 0x01) ? 0x80 : 0x00;
-	        out |= (in & 0x02) ? 0x40 : 0x00;
-	        out |= (in & 0x04) ? 0x20 : 0x00;
-	        out |= (in & 0x08) ? 0x10 : 0x00;
-	        out |= (in & 0x10) ? 0x08 : 0x00;
-	        out |= (in & 0x20) ? 0x04 : 0x00;
-	        out |= (in & 0x40) ? 0x02 : 0x00;
-	        out |= (in & 0x80) ? 0x01 : 0x00;
-
-	return out;
+uint8_t bit_reverse(uint8_t in){
+	return bit_reverse_table[in];
 }
 
 void xfer_spi(uint8_t* data, uint32_t len){
+	if (bridge_active) {
+		bridge_xfer(data, len, false);
+		return;
+	}
+
 	/* Reverse bit order of all bytes */
 	for(int i = 0; i < len; i++){
 		data[i] = bit_reverse(data[i]);
@@ -151,6 +245,10 @@ void xfer_spi(uint8_t* data, uint32_t len){
 }
 
 void send_spi(uint8_t* data, uint32_t len){
+	if (bridge_active) {
+		bridge_write(data, len, true);
+		return;
+	}
 	
 	/* Flip bit order of all bytes */
 	for(int i = 0; i < len; i++){
@@ -167,12 +265,34 @@ void send_spi(uint8_t* data, uint32_t len){
 	}
 }
 
+/* A complete command with nothing to read back: the bridge queues it */
+static void write_spi(uint8_t* data, uint32_t len){
+	if (bridge_active)
+		bridge_write(data, len, false);
+	else
+		xfer_spi(data, len);
+}
+
 
 // ---------------------------------------------------------
 // FLASH function implementations
 // ---------------------------------------------------------
 
-static void flash_read_id()
+/* Builds opcode and address into 'command', returns the number of bytes used */
+static int flash_command(uint8_t *command, uint8_t opcode, uint8_t opcode_4b, uint64_t addr)
+{
+	int n = 0;
+
+	command[n++] = flash_4b_opcodes ? opcode_4b : opcode;
+	if (flash_addr_len == 4)
+		command[n++] = (uint8_t)(addr >> 24);
+	command[n++] = (uint8_t)(addr >> 16);
+	command[n++] = (uint8_t)(addr >> 8);
+	command[n++] = (uint8_t)addr;
+	return n;
+}
+
+static uint32_t flash_read_id()
 {
 	/* JEDEC ID structure:
 	 * Byte No. | Data Type
@@ -197,12 +317,65 @@ static void flash_read_id()
 	for (int i = 1; i < len; i++)
 		fprintf(stderr, " 0x%02X", data[i]);
 	fprintf(stderr, "\n");
+
+	return (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void flash_read_sfdp(uint32_t addr, uint8_t *data, uint32_t len)
+{
+	/* Command, 3 address bytes and one dummy byte precede the data */
+	uint8_t buffer[5 + 256];
+
+	while (len) {
+		uint32_t n = len > 256 ? 256 : len;
+
+		buffer[0] = FC_RSFDP;
+		buffer[1] = (uint8_t)(addr >> 16);
+		buffer[2] = (uint8_t)(addr >> 8);
+		buffer[3] = (uint8_t)addr;
+		memset(buffer + 4, 0, n + 1);
+		xfer_spi(buffer, n + 5);
+		memcpy(data, buffer + 5, n);
+
+		addr += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Discovers page size, erase types and timing, via the cache if possible */
+static void flash_probe(uint32_t jedec_id)
+{
+	sfdp_defaults(&flash, jedec_id);
+
+	/* No flash responding */
+	if (jedec_id == 0 || jedec_id == 0xFFFFFF)
+		return;
+
+	if (sfdp_cache_load(&flash, jedec_id) == 0) {
+		if (verbose)
+			fprintf(stderr, "flash parameters from cache\n");
+	} else if (sfdp_parse(&flash, flash_read_sfdp) == 0) {
+		sfdp_cache_save(&flash);
+	} else {
+		if (verbose)
+			fprintf(stderr, "no SFDP, using default flash parameters\n");
+		sfdp_defaults(&flash, jedec_id);
+	}
+
+	sfdp_print(&flash, verbose);
 }
 
 static void flash_reset()
 {
 	uint8_t data[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
+	if (bridge_active) {
+		bridge_write(data, 8, false);
+		bridge_write(data, 1, false);
+		return;
+	}
+
 	// This disables CRM is if it was enabled
 	jtag_go_to_state(STATE_SHIFT_DR);
 	jtag_tap_shift(data, data, 64, true);
@@ -304,7 +477,7 @@ static void flash_write_enable()
 		fprintf(stderr, "write enable..\n");
 
 	uint8_t data[1] = { FC_WE };
-	xfer_spi(data, 1);
+	write_spi(data, 1);
 
 	if (verbose) {
 		fprintf(stderr, "status after enable:\n");
@@ -312,50 +485,67 @@ static void flash_write_enable()
 	}
 }
 
-static void flash_bulk_erase()
+/* Picks 3- or 4-byte addressing for the probed flash */
+static void flash_setup_addressing()
 {
-	fprintf(stderr, "bulk erase..\n");
+	flash_addr_len = 3;
+	flash_4b_opcodes = false;
+	flash_4b_mode = false;
 
-	uint8_t data[1] = { FC_CE };
-	xfer_spi(data, 1);
-}
+	if (flash.size <= (16 << 20) && flash.addr_mode != SFDP_ADDR_4)
+		return;
 
-static void flash_4kB_sector_erase(int addr)
-{
-	fprintf(stderr, "erase 4kB sector at 0x%06X..\n", addr);
+	flash_addr_len = 4;
+
+	/* Dedicated 4-byte opcodes leave the flash in its power-on mode */
+	if (flash.read_4b && flash.pp_4b && sfdp_erase_type(&flash, 64 << 10, true)) {
+		flash_4b_opcodes = true;
+		if (verbose)
+			fprintf(stderr, "using 4-byte address opcodes\n");
+		return;
+	}
 
-	uint8_t command[4] = { FC_SE, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	if (flash.addr_mode == SFDP_ADDR_4)
+		return;
 
-	xfer_spi(command, 4);
+	if (verbose)
+		fprintf(stderr, "entering 4-byte address mode\n");
+	if (flash.enter_4b & SFDP_4B_WE_B7)
+		flash_write_enable();
+	uint8_t command[1] = { FC_EN4B };
+	xfer_spi(command, 1);
+	flash_4b_mode = true;
 }
 
-static void flash_32kB_sector_erase(int addr)
+static void flash_bulk_erase()
 {
-	fprintf(stderr, "erase 64kB sector at 0x%06X..\n", addr);
-
-	uint8_t command[4] = { FC_BE32, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	fprintf(stderr, "bulk erase..\n");
 
-	xfer_spi(command, 4);
+	uint8_t data[1] = { FC_CE };
+	write_spi(data, 1);
 }
 
-static void flash_64kB_sector_erase(int addr)
+static void flash_sector_erase(const struct flash_erase_type *et, uint64_t addr)
 {
-	fprintf(stderr, "erase 64kB sector at 0x%06X..\n", addr);
+	if (verbose)
+		fprintf(stderr, "erase %ukB sector at 0x%06" PRIX64 "..\n", et->size >> 10, addr);
 
-	uint8_t command[4] = { FC_BE64, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
+	int len = flash_command(command, et->opcode, et->opcode_4b, addr);
 
-	xfer_spi(command, 4);
+	write_spi(command, len);
 }
 
-static void flash_prog(int addr, uint8_t *data, int n)
+static void flash_prog(uint64_t addr, uint8_t *data, int n)
 {
 	if (verbose)
-		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
+		fprintf(stderr, "prog 0x%06" PRIX64 " +0x%03X..\n", addr, n);
 
-	uint8_t command[4] = { FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
+	int len = flash_command(command, FC_PP, flash.pp_4b, addr);
 
-	send_spi(command, 4);
-	xfer_spi(data, n);
+	send_spi(command, len);
+	write_spi(data, n);
 	
 	if (verbose)
 		for (int i = 0; i < n; i++)
@@ -363,14 +553,15 @@ static void flash_prog(int addr, uint8_t *data, int n)
 }
 
 
-static void flash_start_read(int addr)
+static void flash_start_read(uint64_t addr)
 {
 	if (verbose)
-		fprintf(stderr, "Start Read 0x%06X\n", addr);
+		fprintf(stderr, "Start Read 0x%06" PRIX64 "\n", addr);
 
-	uint8_t command[4] = { FC_RD, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
+	int len = flash_command(command, FC_RD, flash.read_4b, addr);
 
-	send_spi(command, 4);
+	send_spi(command, len);
 }
 
 static void flash_continue_read(uint8_t *data, int n)
@@ -378,19 +569,86 @@ static void flash_continue_read(uint8_t *data, int n)
 	if (verbose)
 		fprintf(stderr, "Contiune Read +0x%03X..\n", n);
 
-	memset(data, 0, n);
-	send_spi(data, n);
+	if (bridge_active) {
+		bridge_read(data, n, true);
+	} else {
+		memset(data, 0, n);
+		send_spi(data, n);
+	}
 	
 	if (verbose)
 		for (int i = 0; i < n; i++)
 			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
 }
 
-static void flash_wait()
+/* Size of one readback transfer, the pipeline keeps two of these in use */
+#define FLASH_READ_CHUNK (64 * 1024)
+
+/* Called on the pipeline thread with consecutive pieces of flash content */
+typedef int (*flash_read_cb_t)(void *ctx, const uint8_t *data, uint32_t len);
+
+/*
+ * Reads 'size' bytes starting at 'addr' with a single continuous read command.
+ * While the next chunk is shifted out of the flash, the previous one is handed
+ * to 'cb' on a second thread. Returns the first non-zero result of 'cb'.
+ */
+static int flash_read_stream(uint64_t addr, uint64_t size, enum progress_phase phase, const char *label, flash_read_cb_t cb, void *ctx)
+{
+	struct pipe *p = pipe_open(FLASH_READ_CHUNK, cb, ctx);
+	if (!p) {
+		fprintf(stderr, "can't start readback thread\n");
+		return EXIT_FAILURE;
+	}
+
+	progress_start(phase, label, size, addr);
+	flash_start_read(addr);
+	for (uint64_t done = 0; done < size && !pipe_failed(p); ) {
+		uint32_t n = (size - done > FLASH_READ_CHUNK) ? FLASH_READ_CHUNK : size - done;
+		uint8_t *buffer = pipe_buffer(p);
+
+		flash_continue_read(buffer, n);
+		pipe_push(p, n);
+		done += n;
+		progress_update(done, addr + done);
+	}
+	progress_end();
+
+	/* Leaving SHIFT-DR raises CS and ends the read command */
+	if (bridge_active)
+		bridge_end();
+	else
+		jtag_go_to_state(STATE_RUN_TEST_IDLE);
+
+	return pipe_close(p);
+}
+
+/*
+ * Polls the busy flag until the flash is ready. 'typ_us' is the typical
+ * duration of the operation (0 if unknown): we sleep that long before the
+ * first poll and poll at a fraction of it, instead of every millisecond.
+ */
+static void flash_wait(uint32_t typ_us)
 {
+	/* The bridge polls on its own, in order with the queued commands */
+	if (bridge_active) {
+		bridge_wait();
+		return;
+	}
+
+	trace_begin("flash_wait");
 	if (verbose)
 		fprintf(stderr, "waiting..");
 
+	uint32_t poll_us = 1000;
+	if (typ_us) {
+		mpsse_sleep(typ_us);
+		poll_us = typ_us / 8;
+		if (poll_us < 50)
+			poll_us = 50;
+		if (poll_us > 1000)
+			poll_us = 1000;
+	}
+
 	int count = 0;
 	while (1)
 	{
@@ -420,12 +678,12 @@ static void flash_wait()
 			count = 0;
 		}
 
-		usleep(1000);
+		mpsse_sleep(poll_us);
 	}
 
 	if (verbose)
 		fprintf(stderr, "\n");
-
+	trace_end();
 }
 
 static void flash_disable_protection()
@@ -436,7 +694,7 @@ static void flash_disable_protection()
 	uint8_t data[2] = { FC_WSR1, 0x00 };
 	xfer_spi(data, 2);
 	
-	flash_wait();
+	flash_wait(0);
 	
 	// Read Status Register 1
 	data[0] = FC_RSR1;
@@ -625,7 +883,7 @@ void print_nx_status_register(uint64_t status){
 
 }
 
-static void read_status_register(){
+static uint64_t read_status_register(){
 
 	uint8_t data[8] = {LSC_READ_STATUS};
 
@@ -645,6 +903,7 @@ static void read_status_register(){
 			status = data[i] << 24 | status >> 8;
 
 		print_ecp5_status_register(status);
+		return status;
 	}else if(connected_device.type == TYPE_NX){
 
 		jtag_tap_shift(data, data, 64, true);
@@ -656,7 +915,9 @@ static void read_status_register(){
 			status = (uint64_t)data[i] << 56 | status >> 8;
 
 		print_nx_status_register(status);
+		return status;
 	}
+	return 0;
 }
 
 static void enter_spi_background_mode(){
@@ -724,6 +985,23 @@ uint32_t read_idcode()
 	return idcode;
 }
 
+uint32_t read_usercode()
+{
+	uint8_t data[4] = {USERCODE};
+
+	jtag_go_to_state(STATE_SHIFT_IR);
+	jtag_tap_shift(data, data, 8, true);
+
+	data[0] = 0;
+	jtag_go_to_state(STATE_SHIFT_DR);
+	jtag_tap_shift(data, data, 32, true);
+
+	uint32_t usercode = 0;
+	for(int i = 0; i< 4; i++)
+		usercode = data[i] << 24 | usercode >> 8;
+	return usercode;
+}
+
 uint64_t read_unique_id()
 {
 	jtag_go_to_state(STATE_TEST_LOGIC_RESET);
@@ -743,6 +1021,8 @@ uint64_t read_unique_id()
 	for(int i = 0; i < 8; i++)
 		code = (uint64_t)data[i] << 56 | code >> 8;
 
+	board_unique_id = code;
+
 	printf("Unique ID: %016lx\n", code);
 	printf("  Wafer Lot#: %08x\n", (uint32_t)(code >> 24));
 	printf("  Wafer #: %u\n", (uint32_t)((code >> 19) & 31));
@@ -750,8 +1030,149 @@ uint64_t read_unique_id()
 	return code;
 }
 
-void ecp_prog_sram(FILE *f, bool verbose)
+/* Reads the 16-bit frame CRC register, which LSC_RESET_CRC clears */
+static uint16_t read_frame_crc()
+{
+	uint8_t data[2] = {LSC_READ_CRC};
+
+	jtag_go_to_state(STATE_SHIFT_IR);
+	jtag_tap_shift(data, data, 8, true);
+
+	data[0] = 0;
+	jtag_go_to_state(STATE_SHIFT_DR);
+	jtag_tap_shift(data, data, 16, true);
+
+	return data[0] | data[1] << 8;
+}
+
+#define SRAM_CHUNK (64 * 1024)
+
+static int sram_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	jtag_tap_write(data, len * 8, false);
+	return EXIT_SUCCESS;
+}
+
+static const char *idcode_name(uint32_t idcode)
+{
+	for(int i = 0; i < sizeof(ecp_devices)/sizeof(struct device_id_pair); i++)
+		if(idcode == ecp_devices[i].device_id)
+			return ecp_devices[i].device_name;
+	for(int i = 0; i < sizeof(nx_devices)/sizeof(struct device_id_pair); i++)
+		if(idcode == nx_devices[i].device_id)
+			return nx_devices[i].device_name;
+	return "unknown";
+}
+
+/* The device would reject a bitstream with another VERIFY_ID, but only
+ * once all of it has been sent */
+static bool bitstream_check_device(const struct bitstream_info *info)
+{
+	if (!info->has_idcode) {
+		fprintf(stderr, "warning: no VERIFY_ID in the bitstream header, device not checked\n");
+		return true;
+	}
+	if (info->idcode == connected_device.id)
+		return true;
+
+	fprintf(stderr, "bitstream is for IDCODE 0x%08X (%s), device is 0x%08X (%s)\n",
+		info->idcode, idcode_name(info->idcode),
+		connected_device.id, idcode_name(connected_device.id));
+	return false;
+}
+
+/* Checks the header of a bitstream in the seekable 'f' before it is
+ * written to the flash */
+static void flash_check_bitstream(FILE *f)
+{
+	uint8_t *data = malloc(SRAM_CHUNK);
+	if (!data)
+		return;
+
+	struct bitstream_info info;
+	size_t len = fread(data, 1, SRAM_CHUNK, f);
+	bool ok = bitstream_parse(data, len, &info) || bitstream_check_device(&info);
+	free(data);
+	fseek(f, 0L, SEEK_SET);
+	if (!ok)
+		jtag_error(EXIT_FAILURE);
+}
+
+/* Bytes of the bitstream from the current position of 'f' up to the
+ * trailing padding, -1 if 'f' can't be seeked */
+static long sram_payload_size(FILE *f)
+{
+	long pos = ftell(f);
+	long size;
+	if (pos < 0 || fseek(f, 0L, SEEK_END) == -1 || (size = ftell(f)) < pos)
+		return -1;
+
+	uint8_t *tail = malloc(SRAM_CHUNK);
+	if (!tail) {
+		fseek(f, pos, SEEK_SET);
+		return -1;
+	}
+
+	/* Walk back over the padding, one chunk at a time */
+	long end = size;
+	while (end > pos) {
+		long n = (end - pos < SRAM_CHUNK) ? end - pos : SRAM_CHUNK;
+		if (fseek(f, end - n, SEEK_SET) == -1 || fread(tail, 1, n, f) != (size_t)n) {
+			end = size;
+			break;
+		}
+		long padding = bitstream_padding(tail, n);
+		end -= padding;
+		if (padding < n)
+			break;
+	}
+	free(tail);
+
+	if (size - end > BITSTREAM_PAD_KEEP)
+		size = end + BITSTREAM_PAD_KEEP;
+	return (fseek(f, pos, SEEK_SET) == -1) ? -1 : size - pos;
+}
+
+int ecp_prog_sram(FILE *f, bool verbose)
 {
+	/* The bitstream is read and bit-reversed on this thread, one chunk
+	   ahead of the pipeline thread, which shifts it out as write-only
+	   MPSSE data in a single DR scan */
+	struct pipe *p = pipe_open(SRAM_CHUNK, sram_chunk, NULL);
+	if (!p) {
+		fprintf(stderr, "can't start programming thread\n");
+		jtag_error(EXIT_FAILURE);
+	}
+
+	/* The header is checked before the device is reset, and only the
+	   bitstream between the comments and the trailing padding is sent */
+	long remaining = sram_payload_size(f);
+	if (verbose && remaining >= 0)
+		fprintf(stderr, "%ld bytes up to the trailing padding\n", remaining);
+	uint8_t *buffer = pipe_buffer(p);
+	int rc = fread(buffer, 1, (remaining >= 0 && remaining < SRAM_CHUNK) ? remaining : SRAM_CHUNK, f);
+	if (remaining >= 0)
+		remaining -= rc;
+
+	struct bitstream_info info;
+	struct bitstream_crc crc;
+	if (bitstream_parse(buffer, rc, &info) == 0) {
+		if (!bitstream_check_device(&info)) {
+			pipe_close(p);
+			return EXIT_FAILURE;
+		}
+		bitstream_crc_init(&crc, &info);
+
+		rc -= info.start;
+		memmove(buffer, buffer + info.start, rc);
+		if (verbose)
+			fprintf(stderr, "bitstream%s, %zu bytes of comments and padding skipped at the start\n",
+				info.compressed ? " (compressed)" : "", info.start);
+	} else {
+		fprintf(stderr, "warning: no bitstream preamble, sending as is\n");
+		bitstream_crc_init(&crc, NULL);
+	}
+
 	// ---------------------------------------------------------
 	// Reset
 	// ---------------------------------------------------------
@@ -767,182 +1188,1560 @@ void ecp_prog_sram(FILE *f, bool verbose)
 	// ---------------------------------------------------------
 	// Program
 	// ---------------------------------------------------------
-	const uint32_t len = 16*1024;
-	static unsigned char buffer[16*1024];
+
+	uint64_t sent = 0;
+	double start = report_time();
 
 	fprintf(stderr, "programming..\n");
 	ecp_jtag_cmd(LSC_BITSTREAM_BURST);
-	while (1) {
-		int rc = fread(buffer, 1, len, f);
-		if (rc <= 0)
-			break;
+	jtag_go_to_state(STATE_SHIFT_DR);
+	while (rc > 0) {
 		if (verbose)
 			fprintf(stderr, "sending %d bytes.\n", rc);
 
+		if (sram_crc_check)
+			bitstream_crc_update(&crc, buffer, rc);
 		for(int i = 0; i < rc; i++){
 			buffer[i] = bit_reverse(buffer[i]);
 		}
 
-		jtag_go_to_state(STATE_CAPTURE_DR);
-		jtag_tap_shift(buffer, buffer, rc*8, false);
+		pipe_push(p, rc);
+		sent += rc;
+
+		buffer = pipe_buffer(p);
+		rc = fread(buffer, 1, (remaining >= 0 && remaining < SRAM_CHUNK) ? remaining : SRAM_CHUNK, f);
+		if (remaining >= 0 && rc > 0)
+			remaining -= rc;
+	}
+	pipe_close(p);
+	report_add(REPORT_SRAM, start, sent);
+
+	int ret = EXIT_SUCCESS;
+	if (sram_crc_check && crc.lost) {
+		fprintf(stderr, "warning: can't follow the bitstream commands, CRC not checked\n");
+	} else if (sram_crc_check) {
+		uint16_t device_crc = read_frame_crc();
+		if (device_crc != crc.crc) {
+			fprintf(stderr, "CRC mismatch: device 0x%04X, bitstream 0x%04X\n", device_crc, crc.crc);
+			ret = 3;
+		} else {
+			fprintf(stderr, "CRC OK (0x%04X)\n", crc.crc);
+		}
 	}
 
+	/* Leave configuration mode whether or not the CRC matched */
 	ecp_jtag_cmd(ISC_DISABLE);
 	read_status_register();	
+	return ret;
 }
 
-int ecp_prog_flash(FILE *f, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, int rw_offset, callback_t cb)
+/* Fills 'buffer' with what the erase block at 'block_addr' holds once
+ * programmed: the file where the two overlap, erased bytes elsewhere */
+static int read_block_image(FILE *f, long file_size, uint64_t rw_offset, uint64_t block_addr, uint32_t block_size, uint8_t *buffer)
 {
-	// This has been done before, but as a lib call,
-	// it is nicer when the file size does not need to be passed as an argument.
-	long file_size;
+	uint64_t file_end = rw_offset + file_size;
+	uint64_t begin = (block_addr > rw_offset) ? block_addr : rw_offset;
+	uint64_t end = (block_addr + block_size < file_end) ? block_addr + block_size : file_end;
+
+	memset(buffer, 0xff, block_size);
+	if (begin >= end)
+		return 0;
+	if (fseek(f, begin - rw_offset, SEEK_SET) == -1)
+		return -1;
+	if (fread(buffer + (begin - block_addr), 1, end - begin, f) != end - begin)
+		return -1;
+	return 0;
+}
 
-	if (fseek(f, 0L, SEEK_END) != -1) {
-		file_size = ftell(f);
-		if (file_size == -1) {
-			return EXIT_FAILURE;
-		}
-		if (fseek(f, 0L, SEEK_SET) == -1) {
-			return EXIT_FAILURE;
-		}
-	} else {
-		return EXIT_FAILURE;
+static void prog_plan_free()
+{
+	free(prog_plan.unchanged);
+	free(prog_plan.in_place);
+	free(prog_plan.page_same);
+	memset(&prog_plan, 0, sizeof(prog_plan));
+}
+
+static int prog_plan_init(uint64_t begin, uint64_t end, uint32_t block_size)
+{
+	prog_plan_free();
+
+	prog_plan.begin = begin;
+	prog_plan.block_size = block_size;
+	prog_plan.blocks = (end - begin) / block_size;
+	prog_plan.unchanged = calloc(prog_plan.blocks, sizeof(bool));
+	prog_plan.in_place = calloc(prog_plan.blocks, sizeof(bool));
+	prog_plan.page_same = calloc((end - begin) / flash.page_size, sizeof(bool));
+	if (!prog_plan.unchanged || !prog_plan.in_place || !prog_plan.page_same) {
+		prog_plan_free();
+		return -1;
+	}
+	return 0;
+}
+
+static bool prog_plan_unchanged(uint64_t addr)
+{
+	if (!prog_plan.unchanged || addr < prog_plan.begin)
+		return false;
+
+	uint64_t block = (addr - prog_plan.begin) / prog_plan.block_size;
+	return block < prog_plan.blocks && prog_plan.unchanged[block];
+}
+
+static bool prog_plan_in_place(uint64_t addr)
+{
+	if (!prog_plan.in_place || addr < prog_plan.begin)
+		return false;
+
+	uint64_t block = (addr - prog_plan.begin) / prog_plan.block_size;
+	return block < prog_plan.blocks && prog_plan.in_place[block];
+}
+
+/* True if the page at 'addr' already holds its data */
+static bool prog_plan_page_same(uint64_t addr)
+{
+	return prog_plan_in_place(addr) && prog_plan.page_same[(addr - prog_plan.begin) / flash.page_size];
+}
+
+static int copy_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	memcpy(ctx, data, len);
+	return EXIT_SUCCESS;
+}
+
+static bool flash_index_overlaps(uint64_t addr, uint64_t size)
+{
+	if (flash_index && addr < flash_index_addr + FLASH_INDEX_SIZE && flash_index_addr < addr + size) {
+		fprintf(stderr, "0x%06" PRIX64 " + %" PRIu64 " bytes overlaps the flash index at 0x%06" PRIX64 "\n",
+			addr, size, flash_index_addr);
+		return true;
 	}
+	return false;
+}
 
-	if (disable_protect)
-	{
+static struct board_cache *flash_index_read()
+{
+	free(flash_index_data);
+	flash_index_len = 0;
+	flash_index_erased = 0;
+	flash_index_data = malloc(FLASH_INDEX_SIZE);
+	if (!flash_index_data)
+		return NULL;
+
+	uint8_t *data = flash_index_data;
+	if (flash_read_stream(flash_index_addr, BOARD_CACHE_SECTOR, PROGRESS_READ, "flash index..", copy_chunk, data) == 0) {
+		uint32_t len = board_index_length(data);
+		if (len > BOARD_CACHE_SECTOR && len <= FLASH_INDEX_SIZE &&
+		    flash_read_stream(flash_index_addr + BOARD_CACHE_SECTOR, len - BOARD_CACHE_SECTOR,
+				      PROGRESS_READ, "flash index..", copy_chunk, data + BOARD_CACHE_SECTOR))
+			len = 0;
+		if (len <= FLASH_INDEX_SIZE && board_index_valid(data, len))
+			flash_index_len = len;
+	}
+	fprintf(stderr, "\n");
+
+	if (!flash_index_len) {
+		uint32_t i = 0;
+		while (i < BOARD_CACHE_SECTOR && data[i] == 0xFF)
+			i++;
+		if (i == BOARD_CACHE_SECTOR)
+			flash_index_erased = BOARD_CACHE_SECTOR;
+		fprintf(stderr, "no flash index at 0x%06" PRIX64 "\n", flash_index_addr);
+	}
+	return board_cache_import(data, flash_index_len, flash.size);
+}
+
+/* Erases the index region up to 'len' bytes */
+static int flash_index_erase(uint32_t len)
+{
+	const struct flash_erase_type *et = sfdp_erase_type(&flash, BOARD_CACHE_SECTOR, flash_4b_opcodes);
+	if (!et) {
+		fprintf(stderr, "flash has no 4kB erase for the flash index\n");
+		return -1;
+	}
+
+	for (; flash_index_erased < len; flash_index_erased += et->size) {
 		flash_write_enable();
-		flash_disable_protection();
+		flash_sector_erase(et, flash_index_addr + flash_index_erased);
+		flash_wait(et->typ_ms * 1000);
 	}
-	
-	if (!dont_erase)
-	{
-		if (bulk_erase)
-		{
-			flash_write_enable();
-			flash_bulk_erase();
-			flash_wait();
-		}
-		else
-		{
-			fprintf(stderr, "file size: %ld\n", file_size);
+	return 0;
+}
 
-			int block_size = erase_block_size << 10;
-			int block_mask = block_size - 1;
-			int begin_addr = rw_offset & ~block_mask;
-			int end_addr = (rw_offset + file_size + block_mask) & ~block_mask;
-
-			for (int addr = begin_addr; addr < end_addr; addr += block_size) {
-				flash_write_enable();
-				switch(erase_block_size) {
-					case 4:
-						flash_4kB_sector_erase(addr);
-						break;
-					case 32:
-						flash_32kB_sector_erase(addr);
-						break;
-					case 64:
-						flash_64kB_sector_erase(addr);
-						break;
-				}
-				if (verbose) {
-					fprintf(stderr, "Status after block erase:\n");
-					flash_read_status();
-				}
-				flash_wait();
-			}
+/* Programs 'len' bytes of 'data' to erased flash at 'addr' */
+static int flash_prog_buffer(uint64_t addr, const uint8_t *data, uint32_t len)
+{
+	/* The SPI transfer overwrites what it sends */
+	uint8_t *page = malloc(flash.page_size);
+	if (!page)
+		return -1;
+
+	for (uint32_t done = 0; done < len; ) {
+		uint32_t n = flash.page_size - (addr + done) % flash.page_size;
+		if (n > len - done)
+			n = len - done;
+
+		uint32_t i = 0;
+		while (i < n && data[done + i] == 0xFF)
+			i++;
+		if (i < n) {
+			memcpy(page, data + done, n);
+			flash_write_enable();
+			flash_prog(addr + done, page, n);
+			flash_wait(flash.page_typ_us);
 		}
+		done += n;
 	}
 
-	if (!erase_mode)
-	{
-		for (int rc, addr = 0; true; addr += rc) {
-			uint8_t buffer[256];
+	free(page);
+	return 0;
+}
 
-			/* Show progress */
-			fprintf(stderr, "\r\033[0Kprogramming..  %04u/%04lu", addr, file_size);
+/*
+ * Brings the on-flash index in line with the board cache. Before the flash
+ * is verified, a changed record only erases the old index, so an interrupted
+ * run can't leave an index behind that claims contents the flash lacks.
+ */
+static void flash_index_update(bool verified)
+{
+	uint8_t *data = malloc(FLASH_INDEX_SIZE);
+	if (!data)
+		return;
+
+	uint32_t len = board_cache_export(board_cache, data, FLASH_INDEX_SIZE);
+	if (len && len == flash_index_len && !memcmp(data, flash_index_data, len)) {
+		free(data);
+		return;
+	}
 
-			int page_size = 256 - (rw_offset + addr) % 256;
-			rc = fread(buffer, 1, page_size, f);
-			if (rc <= 0)
-				break;
-			flash_write_enable();
-			flash_prog(rw_offset + addr, buffer, rc);
-			flash_wait();
-			if (cb) {
-				cb();
-			}
+	if (flash_index_len && !flash_index_erased) {
+		flash_index_len = 0;
+		if (flash_index_erase(BOARD_CACHE_SECTOR)) {
+			free(data);
+			return;
 		}
+	}
 
-		fprintf(stderr, "\n");
-		/* seek to the beginning for second pass */
-		fseek(f, 0, SEEK_SET);
+	if (verified && !len)
+		fprintf(stderr, "board cache doesn't fit the %ukB flash index\n", FLASH_INDEX_SIZE >> 10);
+
+	if (verified && len && flash_index_erase(len) == 0 && flash_prog_buffer(flash_index_addr, data, len) == 0) {
+		memcpy(flash_index_data, data, len);
+		flash_index_len = len;
+		flash_index_erased = 0;
+		fprintf(stderr, "flash index: %u bytes written\n", len);
 	}
+	free(data);
+}
 
-	return EXIT_SUCCESS;
+/* Writes the board cache back to where it is kept */
+static void board_cache_sync(bool verified)
+{
+	if (flash_index)
+		flash_index_update(verified);
+	else
+		board_cache_save(board_cache);
 }
 
-void ecp_init_flash_mode()
+/* Reads back random sectors the board cache claims are already programmed,
+ * to catch flash contents changed behind ecpprog's back */
+static bool board_cache_spot_check(uint8_t *buffer)
 {
-	fprintf(stderr, "reset..\n");
-	jtag_go_to_state(STATE_TEST_LOGIC_RESET);
+	uint32_t candidates = 0;
+	bool ok = true;
 
-/* Reset ECP5 to release SPI interface */
-	ecp_jtag_cmd8(ISC_ENABLE, 0);
-	ecp_jtag_cmd8(ISC_ERASE, 0);
-	ecp_jtag_cmd8(ISC_DISABLE, 0);
+	for (uint32_t i = 0; i < prog_plan.blocks; i++)
+		candidates += prog_plan.unchanged[i];
+	if (!candidates || board_spot_checks <= 0)
+		return true;
 
-	/* Put device into SPI bypass mode */
-	enter_spi_background_mode();
+	for (int n = 0; n < board_spot_checks && ok; n++) {
+		uint32_t pick = rand() % candidates;
+		uint32_t block = 0;
 
-	flash_reset();
+		while (!prog_plan.unchanged[block] || pick--)
+			block++;
+
+		uint32_t sectors = prog_plan.block_size / BOARD_CACHE_SECTOR;
+		uint64_t addr = prog_plan.begin + (uint64_t)block * prog_plan.block_size
+			+ (uint64_t)(rand() % sectors) * BOARD_CACHE_SECTOR;
+
+		if (flash_read_stream(addr, BOARD_CACHE_SECTOR, PROGRESS_READ, "spot check..", copy_chunk, buffer) ||
+		    !board_cache_match(board_cache, addr, buffer, BOARD_CACHE_SECTOR))
+			ok = false;
+	}
+	fprintf(stderr, "\n");
 
-	flash_read_id();
+	return ok;
 }
 
-int ecp_flash_verify(FILE *f, int rw_offset)
+/* Works out which of the erase blocks in [begin, end) already hold the image */
+static int prog_plan_build(FILE *f, long file_size, uint64_t rw_offset, uint64_t begin, uint64_t end, uint32_t block_size)
 {
-	// This has been done before, but as a lib call,
-	// it is nicer when the file size does not need to be passed as an argument.
-	long file_size;
+	uint8_t *buffer = malloc(block_size);
+	if (!buffer || prog_plan_init(begin, end, block_size)) {
+		free(buffer);
+		return -1;
+	}
 
-	if (fseek(f, 0L, SEEK_END) != -1) {
-		file_size = ftell(f);
-		if (file_size == -1) {
-			return EXIT_FAILURE;
+	uint32_t skipped = 0;
+	for (uint32_t i = 0; i < prog_plan.blocks; i++) {
+		uint64_t addr = begin + (uint64_t)i * block_size;
+
+		if (read_block_image(f, file_size, rw_offset, addr, block_size, buffer)) {
+			free(buffer);
+			prog_plan_free();
+			return -1;
 		}
-		if (fseek(f, 0L, SEEK_SET) == -1) {
-			return EXIT_FAILURE;
+		if (board_cache_match(board_cache, addr, buffer, block_size)) {
+			prog_plan.unchanged[i] = true;
+			skipped++;
 		}
-	} else {
-		return EXIT_FAILURE;
 	}
 
-	flash_start_read(rw_offset);
-	for (int addr = 0; addr < file_size; addr += 4096) {
-		uint8_t buffer_flash[4096], buffer_file[4096];
+	if (skipped && !board_cache_spot_check(buffer)) {
+		fprintf(stderr, "flash does not match the board cache, reprogramming everything\n");
+		board_cache_clear(board_cache);
+		memset(prog_plan.unchanged, 0, prog_plan.blocks * sizeof(bool));
+		skipped = 0;
+	}
 
-		int rc = fread(buffer_file, 1, 4096, f);
-		if (rc <= 0)
-			break;
-		
-		flash_continue_read(buffer_flash, rc);
-		
-		/* Show progress */
-		fprintf(stderr, "\r\033[0Kverify..       %04u/%04lu", addr + rc, file_size);
-		if (memcmp(buffer_file, buffer_flash, rc)) {
-			fprintf(stderr, "Found difference between flash and file!\n");
+	/* Until verified, blocks about to be rewritten hold unknown data */
+	for (uint32_t i = 0; i < prog_plan.blocks; i++)
+		if (!prog_plan.unchanged[i])
+			board_cache_forget(board_cache, begin + (uint64_t)i * block_size, block_size);
+	board_cache_sync(false);
+
+	fprintf(stderr, "board cache: %u of %u blocks unchanged\n", skipped, prog_plan.blocks);
+
+	free(buffer);
+	return fseek(f, 0, SEEK_SET) == -1 ? -1 : 0;
+}
+
+/* Records the blocks just programmed and verified in the board cache */
+static void board_cache_commit(FILE *f, long file_size, uint64_t rw_offset)
+{
+	uint8_t *buffer = malloc(prog_plan.block_size);
+	if (!buffer)
+		return;
+
+	for (uint32_t i = 0; i < prog_plan.blocks; i++) {
+		uint64_t addr = prog_plan.begin + (uint64_t)i * prog_plan.block_size;
+
+		if (prog_plan.unchanged[i])
+			continue;
+		if (read_block_image(f, file_size, rw_offset, addr, prog_plan.block_size, buffer))
+			break;
+		board_cache_store(board_cache, addr, buffer, prog_plan.block_size);
+	}
+	board_cache_sync(true);
+
+	free(buffer);
+}
+
+struct in_place_check {
+	FILE *f;
+	long file_size;
+	uint64_t rw_offset;
+	uint64_t addr; /* of the next block read back */
+	uint8_t *image;
+};
+
+static int in_place_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	struct in_place_check *c = ctx;
+
+	for (uint32_t off = 0; off < len; off += prog_plan.block_size, c->addr += prog_plan.block_size) {
+		uint32_t block = (c->addr - prog_plan.begin) / prog_plan.block_size;
+		const uint8_t *old = data + off;
+
+		if (prog_plan.unchanged[block])
+			continue;
+		if (read_block_image(c->f, c->file_size, c->rw_offset, c->addr, prog_plan.block_size, c->image))
+			return EXIT_FAILURE;
+
+		/* Programming can only turn 1 bits into 0 */
+		uint32_t i = 0;
+		while (i < prog_plan.block_size && (old[i] & c->image[i]) == c->image[i])
+			i++;
+		if (i < prog_plan.block_size)
+			continue;
+
+		prog_plan.in_place[block] = true;
+		for (i = 0; i < prog_plan.block_size; i += flash.page_size)
+			prog_plan.page_same[(c->addr + i - prog_plan.begin) / flash.page_size] =
+				!memcmp(old + i, c->image + i, flash.page_size);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Reads back the erase blocks in [begin, end) to find those that can be
+ * programmed without an erase */
+static int prog_plan_in_place_check(FILE *f, long file_size, uint64_t rw_offset, uint64_t begin, uint64_t end, uint32_t block_size)
+{
+	if (block_size > FLASH_READ_CHUNK || flash.page_size > block_size) {
+		fprintf(stderr, "in place: %ukB erase blocks not supported\n", block_size >> 10);
+		return 0;
+	}
+	if (!prog_plan.unchanged && prog_plan_init(begin, end, block_size))
+		return -1;
+
+	struct in_place_check c = { f, file_size, rw_offset, begin, malloc(block_size) };
+	if (!c.image)
+		return -1;
+	int rc = flash_read_stream(begin, end - begin, PROGRESS_READ, "reading..", in_place_chunk, &c);
+	fprintf(stderr, "\n");
+	free(c.image);
+	if (rc)
+		return -1;
+
+	uint32_t in_place = 0;
+	for (uint32_t i = 0; i < prog_plan.blocks; i++)
+		in_place += prog_plan.in_place[i];
+	fprintf(stderr, "in place: %u of %u blocks need no erase\n", in_place, prog_plan.blocks);
+
+	return fseek(f, 0, SEEK_SET) == -1 ? -1 : 0;
+}
+
+/* The erase type closest to the requested -i block size */
+static const struct flash_erase_type *flash_pick_erase(int erase_block_size)
+{
+	const struct flash_erase_type *et = sfdp_erase_type(&flash, erase_block_size << 10, flash_4b_opcodes);
+	if (!et) {
+		fprintf(stderr, "flash has no erase type of %dkB or smaller\n", erase_block_size);
+		return NULL;
+	}
+	if (et->size != (erase_block_size << 10))
+		fprintf(stderr, "flash has no %dkB erase, using %ukB\n", erase_block_size, et->size >> 10);
+	return et;
+}
+
+/* Waits for queued flash commands to complete */
+static void flash_sync()
+{
+	if (bridge_active)
+		bridge_sync();
+}
+
+/* The longest a chip erase may take. JESD216 applies the multiplier from
+ * typical to maximum page program time to the chip erase as well. Without
+ * SFDP, allow 200 s per 16 MB, the maximum of common 128 Mbit parts. */
+static uint32_t flash_chip_erase_max_ms()
+{
+	uint32_t mult = flash.page_typ_us ? flash.page_max_us / flash.page_typ_us : 0;
+	if (flash.chip_typ_ms && mult)
+		return flash.chip_typ_ms * mult;
+
+	uint64_t blocks = flash.size ? (flash.size + (16 << 20) - 1) >> 24 : 1;
+	return blocks * 200000;
+}
+
+static void flash_erase_chip()
+{
+	double start = report_time();
+	if (bridge_active)
+		bridge_set_timeout(flash_chip_erase_max_ms());
+	flash_write_enable();
+	flash_bulk_erase();
+	progress_start(PROGRESS_ERASE, "erasing..", flash.size, 0);
+	flash_wait(flash.chip_typ_ms * 1000);
+	progress_update(flash.size, flash.size);
+	progress_end();
+	fprintf(stderr, "\n");
+	report_erase_block(0, flash.size, start);
+}
+
+static void flash_erase_blocks(const struct flash_erase_type *et, uint64_t begin_addr, uint64_t end_addr)
+{
+	progress_start(PROGRESS_ERASE, "erasing..", end_addr - begin_addr, begin_addr);
+	for (uint64_t addr = begin_addr; addr < end_addr; addr += et->size) {
+		progress_update(addr - begin_addr, addr);
+		if (prog_plan_unchanged(addr) || prog_plan_in_place(addr) || (journal && journal_erased(journal, addr)))
+			continue;
+		double start = report_time();
+		flash_write_enable();
+		flash_sector_erase(et, addr);
+		if (verbose) {
+			fprintf(stderr, "Status after block erase:\n");
+			flash_read_status();
+		}
+		flash_wait(et->typ_ms * 1000);
+		report_erase_block(addr, et->size, start);
+
+		if (journal) {
+			flash_sync();
+			journal_erase_done(journal, addr);
+		}
+	}
+	progress_update(end_addr - begin_addr, end_addr);
+	progress_end();
+}
+
+/* Programs 'file_size' bytes of 'f' at 'rw_offset', page by page */
+static int flash_prog_file(FILE *f, long file_size, uint64_t rw_offset)
+{
+	uint8_t *buffer = malloc(flash.page_size);
+	if (!buffer)
+		return EXIT_FAILURE;
+
+	/* Continue where an interrupted run stopped */
+	uint64_t start = 0;
+	if (journal && journal_programmed(journal) > rw_offset) {
+		start = journal_programmed(journal) - rw_offset;
+		if (fseek(f, start, SEEK_SET) == -1) {
+			free(buffer);
+			return EXIT_FAILURE;
+		}
+	}
+
+	progress_start(PROGRESS_PROGRAM, "programming..", file_size, rw_offset);
+	int rc;
+	for (uint64_t addr = start; true; addr += rc) {
+		progress_update(addr, rw_offset + addr);
+
+		if (journal && addr > start && (rw_offset + addr) % journal_block_size(journal) == 0) {
+			flash_sync();
+			journal_program_done(journal, rw_offset + addr);
+		}
+
+		if (prog_plan_unchanged(rw_offset + addr)) {
+			uint64_t next = (rw_offset + addr) / prog_plan.block_size * prog_plan.block_size + prog_plan.block_size;
+			rc = next - (rw_offset + addr);
+			if (fseek(f, addr + rc, SEEK_SET) == -1)
+				break;
+			continue;
+		}
+
+		if (addr >= (uint64_t)file_size)
+			break;
+		int page_size = flash.page_size - (rw_offset + addr) % flash.page_size;
+		if (page_size > file_size - addr)
+			page_size = file_size - addr;
+		if (prog_plan_page_same(rw_offset + addr)) {
+			rc = page_size;
+			if (fseek(f, addr + rc, SEEK_SET) == -1)
+				break;
+			continue;
+		}
+		rc = fread(buffer, 1, page_size, f);
+		if (rc <= 0)
+			break;
+
+		/* Programming 0xFF leaves NOR flash unchanged */
+		int i = 0;
+		while (i < rc && buffer[i] == 0xFF)
+			i++;
+		if (i == rc)
+			continue;
+
+		flash_write_enable();
+		flash_prog(rw_offset + addr, buffer, rc);
+		flash_wait(flash.page_typ_us);
+	}
+	progress_end();
+
+	free(buffer);
+
+	fprintf(stderr, "\n");
+	/* seek to the beginning for second pass */
+	fseek(f, 0, SEEK_SET);
+	return EXIT_SUCCESS;
+}
+
+static int hash_file(FILE *f, long file_size, uint8_t digest[SHA256_SIZE])
+{
+	uint8_t buffer[4096];
+	struct sha256 ctx;
+	sha256_init(&ctx);
+
+	if (fseek(f, 0L, SEEK_SET) == -1)
+		return -1;
+	for (long done = 0; done < file_size; ) {
+		size_t n = (file_size - done < (long)sizeof(buffer)) ? file_size - done : sizeof(buffer);
+		if (fread(buffer, 1, n, f) != n)
+			return -1;
+		sha256_update(&ctx, buffer, n);
+		done += n;
+	}
+	sha256_final(&ctx, digest);
+	return fseek(f, 0L, SEEK_SET);
+}
+
+/* Reads back the last block an interrupted run recorded as programmed,
+ * before the rest of its journal is trusted */
+static bool journal_boundary_ok(FILE *f, long file_size, uint64_t rw_offset)
+{
+	uint32_t block_size = journal_block_size(journal);
+	uint64_t end = journal_programmed(journal);
+	if (end <= rw_offset)
+		return true;
+
+	uint64_t block_addr = (end - 1) / block_size * block_size;
+	uint8_t *expected = malloc(block_size);
+	uint8_t *actual = malloc(block_size);
+	bool ok = expected && actual &&
+	          read_block_image(f, file_size, rw_offset, block_addr, block_size, expected) == 0 &&
+	          flash_read_stream(block_addr, block_size, PROGRESS_READ, "checking..", copy_chunk, actual) == 0 &&
+	          memcmp(expected, actual, block_size) == 0;
+	fprintf(stderr, "\n");
+
+	free(expected);
+	free(actual);
+	fseek(f, 0L, SEEK_SET);
+	return ok;
+}
+
+static void journal_start(FILE *f, long file_size, uint64_t rw_offset, uint32_t block_size)
+{
+	uint8_t digest[SHA256_SIZE];
+	if (hash_file(f, file_size, digest))
+		return;
+
+	journal = journal_open(board_unique_id, digest, rw_offset, file_size, block_size, journal_resume);
+	if (!journal) {
+		fprintf(stderr, "can't write the programming journal\n");
+		return;
+	}
+	if (!journal_resume)
+		return;
+
+	if (!journal_interrupted(journal)) {
+		fprintf(stderr, "no interrupted run of this image, starting from the beginning\n");
+	} else if (!journal_boundary_ok(f, file_size, rw_offset)) {
+		fprintf(stderr, "flash doesn't match the journal, starting from the beginning\n");
+		journal_reset(journal);
+	} else if (journal_programmed(journal)) {
+		fprintf(stderr, "resuming, programmed up to 0x%06" PRIX64 "\n", journal_programmed(journal));
+	} else {
+		fprintf(stderr, "resuming the erase\n");
+	}
+}
+
+static int prog_flash(FILE *f, long file_size, bool seekable, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, uint64_t rw_offset);
+static void flash_error(int status);
+
+int ecp_prog_flash(FILE *f, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, uint64_t rw_offset)
+{
+	// This has been done before, but as a lib call,
+	// it is nicer when the file size does not need to be passed as an argument.
+	long file_size;
+
+	if (fseek(f, 0L, SEEK_END) != -1) {
+		file_size = ftell(f);
+		if (file_size == -1) {
+			return EXIT_FAILURE;
+		}
+		if (fseek(f, 0L, SEEK_SET) == -1) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		return EXIT_FAILURE;
+	}
+
+	return prog_flash(f, file_size, true, disable_protect, dont_erase, bulk_erase, erase_mode, erase_block_size, rw_offset);
+}
+
+/* Erases and programs 'file_size' bytes of 'f'; the board cache can only
+ * skip unchanged blocks if 'f' is 'seekable' */
+static int prog_flash(FILE *f, long file_size, bool seekable, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, uint64_t rw_offset)
+{
+	prog_plan_free();
+
+	if (flash_index_overlaps(rw_offset, file_size))
+		return EXIT_FAILURE;
+
+	if (disable_protect)
+	{
+		flash_write_enable();
+		flash_disable_protection();
+	}
+	
+	/* Only block erase and program leaves contents the board cache can predict */
+	if (board_cache && (dont_erase || bulk_erase)) {
+		if (bulk_erase)
+			board_cache_clear(board_cache);
+		else
+			board_cache_forget(board_cache, rw_offset, file_size);
+		board_cache_sync(false);
+	}
+
+	if (!dont_erase)
+	{
+		if (bulk_erase)
+		{
+			flash_erase_chip();
+		}
+		else
+		{
+			fprintf(stderr, "file size: %ld\n", file_size);
+
+			const struct flash_erase_type *et = flash_pick_erase(erase_block_size);
+			if (!et)
+				return EXIT_FAILURE;
+
+			uint64_t block_size = et->size;
+			uint64_t block_mask = block_size - 1;
+			uint64_t begin_addr = rw_offset & ~block_mask;
+			uint64_t end_addr = (rw_offset + file_size + block_mask) & ~block_mask;
+			if (flash_index_overlaps(begin_addr, end_addr - begin_addr))
+				return EXIT_FAILURE;
+
+			if (board_cache && seekable && !erase_mode && block_size % BOARD_CACHE_SECTOR == 0) {
+				if (prog_plan_build(f, file_size, rw_offset, begin_addr, end_addr, block_size))
+					return EXIT_FAILURE;
+			} else if (board_cache) {
+				board_cache_forget(board_cache, begin_addr, end_addr - begin_addr);
+				board_cache_sync(false);
+			}
+
+			if (in_place_enabled && seekable && !erase_mode &&
+			    prog_plan_in_place_check(f, file_size, rw_offset, begin_addr, end_addr, block_size))
+				return EXIT_FAILURE;
+
+			if (seekable && !erase_mode && board_unique_id)
+				journal_start(f, file_size, rw_offset, block_size);
+
+			flash_erase_blocks(et, begin_addr, end_addr);
+			fprintf(stderr, "\n");
+		}
+	}
+
+	if (!erase_mode) {
+		int ret = flash_prog_file(f, file_size, rw_offset);
+		if (journal) {
+			flash_sync();
+			if (ret)
+				journal_close(journal);
+			else
+				journal_finish(journal);
+			journal = NULL;
+		}
+		return ret;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int ecp_prog_image(const struct image *img, bool disable_protect, bool dont_erase, bool bulk_erase, int erase_block_size)
+{
+	prog_plan_free();
+
+	for (unsigned i = 0; i < img->count; i++) {
+		fprintf(stderr, "segment 0x%06" PRIX64 " +%ld (%s)\n",
+			img->segments[i].addr, img->segments[i].size, img->segments[i].source);
+		if (flash_index_overlaps(img->segments[i].addr, img->segments[i].size))
 			return EXIT_FAILURE;
+	}
+
+	if (disable_protect)
+	{
+		flash_write_enable();
+		flash_disable_protection();
+	}
+
+	if (bulk_erase) {
+		if (board_cache) {
+			board_cache_clear(board_cache);
+			board_cache_sync(false);
+		}
+		flash_erase_chip();
+	} else if (!dont_erase) {
+		const struct flash_erase_type *et = flash_pick_erase(erase_block_size);
+		if (!et)
+			return EXIT_FAILURE;
+
+		/* Erase the union of all segments, each block once, even when
+		 * several segments share it */
+		uint64_t block_mask = et->size - 1;
+
+		for (unsigned i = 0; i < img->count; ) {
+			uint64_t begin_addr = img->segments[i].addr & ~block_mask;
+			uint64_t end_addr = begin_addr;
+
+			for (; i < img->count && (img->segments[i].addr & ~block_mask) <= end_addr; i++)
+				end_addr = (img->segments[i].addr + img->segments[i].size + block_mask) & ~block_mask;
+
+			if (flash_index_overlaps(begin_addr, end_addr - begin_addr))
+				return EXIT_FAILURE;
+			if (board_cache) {
+				board_cache_forget(board_cache, begin_addr, end_addr - begin_addr);
+				board_cache_sync(false);
+			}
+			flash_erase_blocks(et, begin_addr, end_addr);
+			fprintf(stderr, "\n");
+		}
+	}
+
+	if (board_cache) {
+		for (unsigned i = 0; i < img->count; i++)
+			board_cache_forget(board_cache, img->segments[i].addr, img->segments[i].size);
+		board_cache_sync(false);
+	}
+
+	for (unsigned i = 0; i < img->count; i++) {
+		const struct image_segment *s = &img->segments[i];
+		if (flash_prog_file(s->f, s->size, s->addr))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void ecp_init_flash_mode()
+{
+	double start = report_time();
+
+	if (bridge_path) {
+		FILE *f = fopen(bridge_path, "rb");
+		if (f == NULL) {
+			fprintf(stderr, "can't open '%s' for reading: ", bridge_path);
+			perror(0);
+			jtag_error(EXIT_FAILURE);
+		}
+
+		/* Loading the bridge resets the FPGA as well */
+		fprintf(stderr, "loading SPI bridge..\n");
+		int ret = ecp_prog_sram(f, verbose);
+		fclose(f);
+		if (ret || bridge_open(flash_error))
+			jtag_error(EXIT_FAILURE);
+		bridge_active = true;
+		/* The load counts as SRAM time */
+		start = report_time();
+	} else {
+		fprintf(stderr, "reset..\n");
+		jtag_go_to_state(STATE_TEST_LOGIC_RESET);
+
+		/* Reset ECP5 to release SPI interface */
+		ecp_jtag_cmd8(ISC_ENABLE, 0);
+		ecp_jtag_cmd8(ISC_ERASE, 0);
+		ecp_jtag_cmd8(ISC_DISABLE, 0);
+
+		/* Put device into SPI bypass mode */
+		enter_spi_background_mode();
+	}
+
+	flash_reset();
+
+	if (dryrun_active) {
+		flash_probe(dry_run_jedec_id);
+		dryrun_flash_times(&flash);
+	} else {
+		flash_probe(flash_read_id());
+	}
+	flash_setup_addressing();
+	report_add(REPORT_FLASH_RESET, start, 0);
+
+	/* Queued commands keep the bridge busy for up to a block erase */
+	if (bridge_active) {
+		uint32_t erase_max_ms = 0;
+		for (int i = 0; i < SFDP_ERASE_TYPES; i++)
+			if (flash.erase[i].max_ms > erase_max_ms)
+				erase_max_ms = flash.erase[i].max_ms;
+		bridge_set_timeout(erase_max_ms);
+	}
+
+	/* Without a known size, the flash is addressed with 3 bytes */
+	uint64_t flash_end = flash.size ? flash.size : 16 << 20;
+	if (flash_index && flash_index_addr + FLASH_INDEX_SIZE > flash_end) {
+		fprintf(stderr, "flash index at 0x%" PRIX64 " + %d bytes exceeds the %" PRIu64 " MB flash\n",
+			flash_index_addr, FLASH_INDEX_SIZE, flash_end >> 20);
+		flash_error(EXIT_FAILURE);
+	}
+
+	board_cache_close(board_cache);
+	board_cache = NULL;
+	if (flash_index)
+		board_cache = flash_index_read();
+	else if (board_cache_enabled && board_unique_id)
+		board_cache = board_cache_open(board_unique_id, flash.jedec_id, flash.size);
+}
+
+/* Returns the flash to 3-byte addressing so the ECP5 can boot from it */
+void ecp_exit_flash_mode()
+{
+	if (flash_4b_mode) {
+		if (verbose)
+			fprintf(stderr, "leaving 4-byte address mode\n");
+		if (flash.exit_4b & SFDP_4B_WE_B7)
+			flash_write_enable();
+		uint8_t command[1] = { FC_EX4B };
+		xfer_spi(command, 1);
+		flash_4b_mode = false;
+	}
+
+	/* The bridge is replaced by the design in the flash */
+	if (bridge_active) {
+		bridge_sync();
+		bridge_active = false;
+		fprintf(stderr, "rebooting ECP5...\n");
+		double start = report_time();
+		ecp_jtag_cmd(LSC_REFRESH);
+		report_add(REPORT_REFRESH, start, 0);
+	}
+}
+
+/* Aborts with 'status' after leaving flash mode, so an error or a failed
+ * verify doesn't leave the flash in 4-byte mode or the bridge running */
+static void flash_error(int status)
+{
+	ecp_exit_flash_mode();
+	jtag_error(status);
+}
+
+struct verify_state {
+	FILE *f;
+	uint64_t addr;        /* of the next byte read back */
+	uint64_t begin;       /* of the first sector in 'bad' */
+	uint32_t sector_size;
+	uint32_t sectors;
+	bool *bad;            /* sectors that differ, NULL to stop at the first */
+	uint32_t bad_count;
+};
+
+static int verify_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	struct verify_state *v = ctx;
+	static uint8_t buffer_file[FLASH_READ_CHUNK];
+
+	if (fread(buffer_file, 1, len, v->f) != len || (!v->bad && memcmp(buffer_file, data, len))) {
+		fprintf(stderr, "Found difference between flash and file!\n");
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t off = 0, n; v->bad && off < len; off += n) {
+		uint32_t sector = (v->addr + off - v->begin) / v->sector_size;
+		n = v->begin + (uint64_t)(sector + 1) * v->sector_size - (v->addr + off);
+		if (n > len - off)
+			n = len - off;
+		if (!v->bad[sector] && memcmp(buffer_file + off, data + off, n)) {
+			v->bad[sector] = true;
+			v->bad_count++;
+		}
+	}
+	v->addr += len;
+	return EXIT_SUCCESS;
+}
+
+/* Rewrites the sector at 'addr' with the file where the two overlap and
+ * its current contents elsewhere */
+static int repair_sector(FILE *f, long file_size, uint64_t rw_offset, const struct flash_erase_type *et,
+                         uint64_t addr, uint8_t *image)
+{
+	uint64_t begin = (addr > rw_offset) ? addr : rw_offset;
+	uint64_t end = (addr + et->size < rw_offset + file_size) ? addr + et->size : rw_offset + file_size;
+
+	int rc = flash_read_stream(addr, et->size, PROGRESS_READ, "repair..", copy_chunk, image);
+	fprintf(stderr, "\n");
+	if (rc || fseek(f, begin - rw_offset, SEEK_SET) == -1 ||
+	    fread(image + (begin - addr), 1, end - begin, f) != end - begin)
+		return -1;
+
+	flash_write_enable();
+	flash_sector_erase(et, addr);
+	flash_wait(et->typ_ms * 1000);
+	return flash_prog_buffer(addr, image, et->size) ? -1 : 0;
+}
+
+static int flash_verify_pass(struct verify_state *v, long file_size, uint64_t rw_offset);
+
+/* Rewrites the sectors verify found to differ, then verifies the whole
+ * image again, since an erase may disturb its neighbours, until it reads
+ * back right or the --repair rounds are used up */
+static int flash_repair(struct verify_state *v, long file_size, uint64_t rw_offset)
+{
+	const struct flash_erase_type *et = sfdp_erase_type(&flash, v->sector_size, flash_4b_opcodes);
+	if (!et || et->size != v->sector_size) {
+		fprintf(stderr, "\nflash has no 4kB erase to repair with\n");
+		return EXIT_FAILURE;
+	}
+
+	uint8_t *image = malloc(v->sector_size);
+	int rc = image ? 0 : -1;
+
+	for (int round = 1; round <= repair_rounds && v->bad_count && rc >= 0; round++) {
+		fprintf(stderr, "\nrepair %d/%d: %u sector(s) differ\n", round, repair_rounds, v->bad_count);
+
+		for (uint32_t i = 0; i < v->sectors && rc >= 0; i++) {
+			if (v->bad[i])
+				rc = repair_sector(v->f, file_size, rw_offset, et, v->begin + (uint64_t)i * v->sector_size, image);
 		}
+		if (rc >= 0 && flash_verify_pass(v, file_size, rw_offset))
+			rc = -1;
 	}
+
+	free(image);
+	if (rc < 0 || v->bad_count) {
+		fprintf(stderr, "Found difference between flash and file in %u sector(s)!\n", v->bad_count);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+int ecp_image_verify(const struct image *img)
+{
+	for (unsigned i = 0; i < img->count; i++) {
+		if (ecp_flash_verify(img->segments[i].f, img->segments[i].addr))
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Compares 'file_size' bytes of 'f' with the flash at 'rw_offset' */
+static int flash_verify_file(FILE *f, long file_size, uint64_t rw_offset)
+{
+	struct verify_state v = { .f = f, .addr = rw_offset };
+
+	/* Repair needs to go back to the file */
+	if (repair_rounds > 0 && fseek(f, 0L, SEEK_CUR) != -1) {
+		v.sector_size = BOARD_CACHE_SECTOR;
+		v.begin = rw_offset / v.sector_size * v.sector_size;
+		v.sectors = (rw_offset + file_size - v.begin + v.sector_size - 1) / v.sector_size;
+		v.bad = calloc(v.sectors ? v.sectors : 1, sizeof(bool));
+		if (!v.bad)
+			return EXIT_FAILURE;
+	}
+
+	int rc = flash_verify_pass(&v, file_size, rw_offset);
+	if (!rc && v.bad_count)
+		rc = flash_repair(&v, file_size, rw_offset);
+	free(v.bad);
+	if (rc)
+		return EXIT_FAILURE;
 	fprintf(stderr, "  VERIFY OK\n");
+
+	if (prog_plan.unchanged) {
+		if (board_cache)
+			board_cache_commit(f, file_size, rw_offset);
+		prog_plan_free();
+		fseek(f, 0, SEEK_SET);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Readback of a dry run, where the model only returns zeros */
+static int discard_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	return EXIT_SUCCESS;
+}
+
+/* Reads back the image and compares it with the file. With --repair, the
+ * sectors that differ are flagged in 'v->bad' instead of stopping at the
+ * first one. */
+static int flash_verify_pass(struct verify_state *v, long file_size, uint64_t rw_offset)
+{
+	FILE *f = v->f;
+	int rc = EXIT_SUCCESS;
+	flash_read_cb_t compare = dryrun_active ? discard_chunk : verify_chunk;
+
+	v->addr = rw_offset;
+	if (v->bad) {
+		memset(v->bad, 0, v->sectors * sizeof(bool));
+		v->bad_count = 0;
+		if (fseek(f, 0L, SEEK_SET) == -1)
+			return EXIT_FAILURE;
+	}
+
+	if (!prog_plan.unchanged) {
+		rc = flash_read_stream(rw_offset, file_size, PROGRESS_VERIFY, "verify..", compare, v);
+	} else {
+		/* Read back only the runs of blocks that were reprogrammed */
+		uint64_t file_end = rw_offset + file_size;
+		for (uint32_t i = 0; i < prog_plan.blocks && !rc; ) {
+			if (prog_plan.unchanged[i]) {
+				i++;
+				continue;
+			}
+
+			uint32_t j = i;
+			while (j < prog_plan.blocks && !prog_plan.unchanged[j])
+				j++;
+
+			uint64_t begin = prog_plan.begin + (uint64_t)i * prog_plan.block_size;
+			uint64_t end = prog_plan.begin + (uint64_t)j * prog_plan.block_size;
+			if (begin < rw_offset)
+				begin = rw_offset;
+			if (end > file_end)
+				end = file_end;
+
+			if (begin < end) {
+				v->addr = begin;
+				if (fseek(f, begin - rw_offset, SEEK_SET) == -1 ||
+				    flash_read_stream(begin, end - begin, PROGRESS_VERIFY, "verify..", compare, v))
+					rc = EXIT_FAILURE;
+			}
+			i = j;
+		}
+	}
+	return rc;
+}
+
+int ecp_flash_verify(FILE *f, uint64_t rw_offset)
+{
+	// This has been done before, but as a lib call,
+	// it is nicer when the file size does not need to be passed as an argument.
+	long file_size;
+
+	if (fseek(f, 0L, SEEK_END) != -1) {
+		file_size = ftell(f);
+		if (file_size == -1) {
+			return EXIT_FAILURE;
+		}
+		if (fseek(f, 0L, SEEK_SET) == -1) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		return EXIT_FAILURE;
+	}
+
+	return flash_verify_file(f, file_size, rw_offset);
+}
+
+static int write_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	return sparse_write(ctx, data, len) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Streaming programming: input that can't be rewound (a pipe from a build,
+ * download or decompressor) is erased and programmed as it arrives. Only a
+ * digest per STREAM_BLOCK is kept, the verify pass compares against those. */
+
+#define STREAM_BLOCK (64 * 1024)
+
+struct stream_hash {
+	uint64_t addr;          /* flash address of the next byte */
+	uint64_t block_addr;    /* flash address of the block being hashed */
+	struct sha256 hash;
+	uint8_t (*digests)[SHA256_SIZE];
+	uint32_t blocks;        /* digests recorded, or checked */
+	uint32_t alloc;
+	bool check;             /* compare with 'digests' instead of recording */
+};
+
+/* Ends the current block, returns EXIT_FAILURE on a mismatch */
+static int stream_hash_block(struct stream_hash *h)
+{
+	uint8_t digest[SHA256_SIZE];
+	sha256_final(&h->hash, digest);
+
+	if (h->check) {
+		if (memcmp(digest, h->digests[h->blocks], SHA256_SIZE)) {
+			fprintf(stderr, "Found difference between flash and file in 0x%06" PRIX64 "..0x%06" PRIX64 "!\n",
+				h->block_addr, h->addr - 1);
+			return EXIT_FAILURE;
+		}
+	} else {
+		if (h->blocks == h->alloc) {
+			uint32_t alloc = h->alloc ? h->alloc * 2 : 64;
+			void *digests = realloc(h->digests, alloc * sizeof(*h->digests));
+			if (!digests) {
+				fprintf(stderr, "out of memory\n");
+				return EXIT_FAILURE;
+			}
+			h->digests = digests;
+			h->alloc = alloc;
+		}
+		memcpy(h->digests[h->blocks], digest, SHA256_SIZE);
+	}
+
+	h->blocks++;
+	h->block_addr = h->addr;
+	sha256_init(&h->hash);
+	return EXIT_SUCCESS;
+}
+
+static int stream_hash_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	struct stream_hash *h = ctx;
+
+	while (len) {
+		uint32_t n = STREAM_BLOCK - h->addr % STREAM_BLOCK;
+		if (n > len)
+			n = len;
+
+		sha256_update(&h->hash, data, n);
+		h->addr += n;
+		data += n;
+		len -= n;
+
+		if (h->addr % STREAM_BLOCK == 0 && stream_hash_block(h))
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static void stream_hash_start(struct stream_hash *h, uint64_t addr, bool check)
+{
+	h->addr = h->block_addr = addr;
+	h->blocks = 0;
+	h->check = check;
+	sha256_init(&h->hash);
+}
+
+/* Ends a pass over the data, including a partial last block */
+static int stream_hash_end(struct stream_hash *h)
+{
+	if (h->addr != h->block_addr)
+		return stream_hash_block(h);
+	return EXIT_SUCCESS;
+}
+
+/* Programs 'prefix' and everything that follows in 'f' at 'rw_offset',
+ * erasing each block just before the first page that lands in it */
+static int flash_prog_stream(FILE *f, const uint8_t *prefix, size_t prefix_len, bool disable_protect, bool dont_erase, bool bulk_erase, int erase_block_size, bool verify, uint64_t rw_offset)
+{
+	const struct flash_erase_type *et = NULL;
+	uint64_t addr = rw_offset;
+	uint64_t erased_begin = rw_offset, erased_end = rw_offset;
+	struct stream_hash h = { 0 };
+	int ret = EXIT_FAILURE;
+
+	prog_plan_free();
+
+	uint8_t *buffer = malloc(flash.page_size);
+	if (!buffer)
+		return EXIT_FAILURE;
+
+	if (disable_protect)
+	{
+		flash_write_enable();
+		flash_disable_protection();
+	}
+
+	if (bulk_erase)
+	{
+		flash_erase_chip();
+	}
+	else if (!dont_erase)
+	{
+		et = flash_pick_erase(erase_block_size);
+		if (!et)
+			goto out;
+		erased_begin = erased_end = rw_offset & ~((uint64_t)et->size - 1);
+	}
+
+	fprintf(stderr, "streaming input, programming as it arrives\n");
+	stream_hash_start(&h, rw_offset, false);
+	progress_start(PROGRESS_PROGRAM, "programming..", 0, rw_offset);
+
+	while (true) {
+		size_t page_size = flash.page_size - addr % flash.page_size;
+		size_t n = (prefix_len < page_size) ? prefix_len : page_size;
+
+		memcpy(buffer, prefix, n);
+		prefix += n;
+		prefix_len -= n;
+		n += fread(buffer + n, 1, page_size - n, f);
+		if (n == 0)
+			break;
+
+		if (flash.size && addr + n > flash.size) {
+			progress_end();
+			fprintf(stderr, "\ninput exceeds the %" PRIu64 " MB flash\n", flash.size >> 20);
+			goto out;
+		}
+
+		if (et && addr + n > erased_end) {
+			uint64_t end = (addr + n + et->size - 1) & ~((uint64_t)et->size - 1);
+			flash_erase_blocks(et, erased_end, end);
+			erased_end = end;
+		}
+
+		progress_update(addr - rw_offset, addr);
+
+		if (stream_hash_chunk(&h, buffer, n)) {
+			progress_end();
+			goto out;
+		}
+
+		/* Programming 0xFF leaves NOR flash unchanged */
+		size_t i = 0;
+		while (i < n && buffer[i] == 0xFF)
+			i++;
+		if (i < n) {
+			flash_write_enable();
+			flash_prog(addr, buffer, n);
+			flash_wait(flash.page_typ_us);
+		}
+
+		addr += n;
+		if (n < page_size)
+			break;
+	}
+	progress_update(addr - rw_offset, addr);
+	progress_end();
+	fprintf(stderr, "\n");
+
+	if (ferror(f)) {
+		fprintf(stderr, "error reading input\n");
+		goto out;
+	}
+	if (stream_hash_end(&h))
+		goto out;
+
+	if (verify) {
+		stream_hash_start(&h, rw_offset, true);
+		if (flash_read_stream(rw_offset, addr - rw_offset, PROGRESS_VERIFY, "verify..", stream_hash_chunk, &h) ||
+		    stream_hash_end(&h))
+			goto out;
+		fprintf(stderr, "  VERIFY OK\n");
+	}
+	ret = EXIT_SUCCESS;
+
+out:
+	/* Whatever happened, the board cache no longer knows these blocks */
+	if (board_cache && addr > rw_offset) {
+		if (erased_end < addr)
+			erased_end = addr;
+		board_cache_forget(board_cache, erased_begin, erased_end - erased_begin);
+		board_cache_sync(false);
+	}
+	free(h.digests);
+	free(buffer);
+	return ret;
+}
+
+#define HASH_SECTOR 4096
+#define HASH_END 2 /* hash_chunk() return value: end of bitstream, not an error */
+
+struct flash_hash {
+	FILE *out;
+	uint64_t addr;          /* flash address of sector[0] */
+	uint32_t fill;
+	uint8_t sector[HASH_SECTOR];
+	struct sha256 range;
+	bool stop_at_end;
+	bool bitstream;         /* preamble seen in the first sector */
+	bool first;
+};
+
+static void print_digest(FILE *out, const uint8_t *digest)
+{
+	for (int i = 0; i < SHA256_SIZE; i++)
+		fprintf(out, "%02x", digest[i]);
+	fprintf(out, "\n");
+}
+
+/* Emits the digest of the buffered sector, returns HASH_END if it is blank
+ * flash following a bitstream */
+static int hash_sector(struct flash_hash *h)
+{
+	uint8_t digest[SHA256_SIZE];
+
+	if (h->first) {
+		/* ECP5 bitstreams start with 0xFF padding and the 0xBDB3 preamble */
+		for (uint32_t i = 2; i + 1 < h->fill; i++)
+			if (h->sector[i - 2] == 0xFF && h->sector[i - 1] == 0xFF &&
+			    h->sector[i] == 0xBD && h->sector[i + 1] == 0xB3)
+				h->bitstream = true;
+		h->first = false;
+	} else if (h->stop_at_end && h->bitstream) {
+		uint32_t i = 0;
+		while (i < h->fill && h->sector[i] == 0xFF)
+			i++;
+		if (i == h->fill)
+			return HASH_END;
+	}
+
+	sha256(h->sector, h->fill, digest);
+	sha256_update(&h->range, h->sector, h->fill);
+	fprintf(h->out, "sector %06" PRIx64 " %x ", h->addr, h->fill);
+	print_digest(h->out, digest);
+
+	h->addr += h->fill;
+	h->fill = 0;
+	return EXIT_SUCCESS;
+}
+
+/* Runs on the readback thread, splits the stream into sectors */
+static int hash_chunk(void *ctx, const uint8_t *data, uint32_t len)
+{
+	struct flash_hash *h = ctx;
+
+	while (len) {
+		uint32_t n = HASH_SECTOR - (h->addr + h->fill) % HASH_SECTOR;
+		if (n > len)
+			n = len;
+
+		memcpy(h->sector + h->fill, data, n);
+		h->fill += n;
+		data += n;
+		len -= n;
+
+		if ((h->addr + h->fill) % HASH_SECTOR == 0) {
+			int rc = hash_sector(h);
+			if (rc)
+				return rc;
+		}
+	}
 	return EXIT_SUCCESS;
 }
 
+/* Writes per-sector and whole-range SHA-256 digests of the flash to 'out' */
+static int flash_hash(FILE *out, uint64_t addr, uint64_t size, bool stop_at_end)
+{
+	static struct flash_hash h;
+	uint8_t digest[SHA256_SIZE];
+
+	memset(&h, 0, sizeof(h));
+	h.out = out;
+	h.addr = addr;
+	h.stop_at_end = stop_at_end;
+	h.first = true;
+	sha256_init(&h.range);
+
+	fprintf(out, "flash %06x %" PRIu64 "\n", flash.jedec_id, flash.size);
+	fprintf(out, "board %016" PRIx64 "\n", board_unique_id);
+
+	int rc = flash_read_stream(addr, size, PROGRESS_READ, "hashing..", hash_chunk, &h);
+	fprintf(stderr, "\n");
+	if (rc == EXIT_SUCCESS && h.fill)
+		rc = hash_sector(&h);
+	if (rc == HASH_END)
+		fprintf(stderr, "end of bitstream at 0x%06" PRIx64 "\n", h.addr);
+	else if (rc)
+		return EXIT_FAILURE;
+
+	sha256_final(&h.range, digest);
+	fprintf(out, "range %06" PRIx64 " %" PRIx64 " ", addr, h.addr - addr);
+	print_digest(out, digest);
+
+	return fflush(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 // ---------------------------------------------------------
 // iceprog implementation
 // ---------------------------------------------------------
 
+static int slot_read_header()
+{
+	uint8_t data[SLOT_HEADER_SIZE];
+	int rc = flash_read_stream(SLOT_HEADER_ADDR, SLOT_HEADER_SIZE, PROGRESS_READ, "slot header..", copy_chunk, data);
+	fprintf(stderr, "\n");
+	if (rc)
+		return -1;
+
+	slot_header_parse(data, slot_addr, &slot_header);
+	return 0;
+}
+
+/* Rewrites the header sector from 'slot_header' and reads it back */
+static int slot_write_header()
+{
+	uint8_t data[SLOT_HEADER_SIZE], check[SLOT_HEADER_SIZE];
+
+	const struct flash_erase_type *et = sfdp_erase_type(&flash, SLOT_HEADER_SIZE, flash_4b_opcodes);
+	if (!et) {
+		fprintf(stderr, "flash has no 4kB erase for the slot header\n");
+		return EXIT_FAILURE;
+	}
+	if (flash_index_overlaps(SLOT_HEADER_ADDR, SLOT_HEADER_SIZE))
+		return EXIT_FAILURE;
+
+	if (board_cache) {
+		board_cache_forget(board_cache, SLOT_HEADER_ADDR, SLOT_HEADER_SIZE);
+		board_cache_sync(false);
+	}
+
+	slot_header_build(data, &slot_header, slot_addr);
+	for (uint32_t addr = 0; addr < SLOT_HEADER_SIZE; addr += et->size) {
+		flash_write_enable();
+		flash_sector_erase(et, SLOT_HEADER_ADDR + addr);
+		flash_wait(et->typ_ms * 1000);
+	}
+	if (flash_prog_buffer(SLOT_HEADER_ADDR, data, SLOT_HEADER_SIZE))
+		return EXIT_FAILURE;
+
+	int rc = flash_read_stream(SLOT_HEADER_ADDR, SLOT_HEADER_SIZE, PROGRESS_READ, "slot header..", copy_chunk, check);
+	fprintf(stderr, "\n");
+	if (rc || memcmp(data, check, SLOT_HEADER_SIZE)) {
+		fprintf(stderr, "slot header verify failed\n");
+		return 3;
+	}
+
+	if (board_cache) {
+		board_cache_store(board_cache, SLOT_HEADER_ADDR, data, SLOT_HEADER_SIZE);
+		board_cache_sync(true);
+	}
+	fprintf(stderr, "slot %c is active\n", 'A' + slot_header.active);
+	return EXIT_SUCCESS;
+}
+
+static void slot_print_status()
+{
+	for (int i = 0; i < 2; i++) {
+		const struct slot_image *img = &slot_header.slots[i];
+
+		printf("slot %c  0x%06X  %-8s  ", 'A' + i, slot_addr[i], slot_header.active == i ? "active" : "inactive");
+		if (img->size) {
+			printf("%u bytes  ", img->size);
+			print_digest(stdout, img->hash);
+		} else {
+			printf("unknown contents\n");
+		}
+	}
+	if (slot_header.active < 0)
+		printf("the header at 0x%06X jumps to neither slot\n", SLOT_HEADER_ADDR);
+}
+
+/* Boots the other slot, if it holds a recorded image */
+static int slot_switch()
+{
+	int target = (slot_header.active == 0) ? 1 : 0;
+
+	if (slot_header.active < 0) {
+		fprintf(stderr, "no slot is active, program one first\n");
+		return EXIT_FAILURE;
+	}
+	if (!slot_header.slots[target].size) {
+		fprintf(stderr, "slot %c holds no recorded image\n", 'A' + target);
+		return EXIT_FAILURE;
+	}
+
+	slot_header.active = target;
+	return slot_write_header();
+}
+
+/* Records the image just programmed and verified in slot 'target' and
+ * boots it */
+static int slot_activate(int target, FILE *f, long file_size)
+{
+	struct slot_image *img = &slot_header.slots[target];
+
+	if (hash_file(f, file_size, img->hash))
+		return EXIT_FAILURE;
+	img->size = file_size;
+	slot_header.active = target;
+	return slot_write_header();
+}
+
+/* Parses a size or an address, with an optional 'k' or 'M' suffix. False if
+ * it is negative, malformed or beyond what a file offset can hold. */
+static bool parse_size(const char *arg, uint64_t *value)
+{
+	char *endptr;
+
+	if (strchr(arg, '-'))
+		return false;
+
+	errno = 0;
+	uint64_t v = strtoull(arg, &endptr, 0);
+	if (errno == ERANGE || endptr == arg)
+		return false;
+
+	uint64_t unit = 1;
+	if (!strcmp(endptr, "k"))
+		unit = 1024;
+	else if (!strcmp(endptr, "M"))
+		unit = 1024 * 1024;
+	else if (*endptr != '\0')
+		return false;
+
+	if (v > INT64_MAX / unit)
+		return false;
+	*value = v * unit;
+	return true;
+}
+
 static void help(const char *progname)
 {
 	fprintf(stderr, "Simple programming tool for Lattice ECP5/NX using FTDI-based JTAG programmers.\n");
@@ -963,8 +2762,8 @@ static void help(const char *progname)
 	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
 	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
 	fprintf(stderr, "  -k <divider>          divider for SPI clock [default: 1]\n");
-	fprintf(stderr, "                          clock speed is 6MHz/divider");
-	fprintf(stderr, "  -s                    slow SPI. (50 kHz instead of 6 MHz)\n");
+	fprintf(stderr, "                          clock speed is 30MHz/divider\n");
+	fprintf(stderr, "  -s                    slow SPI. (1 MHz instead of 30 MHz)\n");
 	fprintf(stderr, "                          Equivalent to -k 30\n");
 	fprintf(stderr, "  -v                    verbose output\n");
 	fprintf(stderr, "  -i [4,32,64]          select erase block size [default: 64k]\n");
@@ -972,13 +2771,41 @@ static void help(const char *progname)
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Mode of operation:\n");
 	fprintf(stderr, "  [default]             write file contents to flash, then verify\n");
+	fprintf(stderr, "                          Input from a pipe is erased and programmed as it\n");
+	fprintf(stderr, "                          arrives and verified against SHA-256 digests.\n");
+	fprintf(stderr, "      --resume          continue a run that was interrupted, skipping the\n");
+	fprintf(stderr, "                          blocks its journal shows as erased or programmed\n");
 	fprintf(stderr, "  -X                    write file contents to flash only\n");	
 	fprintf(stderr, "  -r                    read first 256 kB from flash and write to file\n");
 	fprintf(stderr, "  -R <size in bytes>    read the specified number of bytes from flash\n");
 	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
 	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
+	fprintf(stderr, "      --sparse          with -r/-R, leave runs of erased bytes out of the\n");
+	fprintf(stderr, "                          file; such files are accepted for programming\n");
+	fprintf(stderr, "      --trim            with -r/-R, end the file at the last byte that is\n");
+	fprintf(stderr, "                          not erased (0xFF)\n");
+	fprintf(stderr, "      --manifest        the input file lists \"<offset> <file>\" lines; all files\n");
+	fprintf(stderr, "                          are erased, programmed and verified in one session\n");
+	fprintf(stderr, "                          (Intel HEX and ELF input is detected automatically)\n");
+	fprintf(stderr, "  -H                    write SHA-256 digests of each 4kB sector and of the\n");
+	fprintf(stderr, "                          whole range to file instead of the data itself\n");
+	fprintf(stderr, "                          [default range: the whole flash, or -R bytes]\n");
+	fprintf(stderr, "      --bitstream-end   with -H, stop at the first erased sector after a\n");
+	fprintf(stderr, "                          bitstream\n");
+	fprintf(stderr, "      --bridge <file>   reach the flash through an SPI bridge design loaded\n");
+	fprintf(stderr, "                          into SRAM first, the FPGA reboots afterwards\n");
 	fprintf(stderr, "  -c                    do not write flash, only verify (`check')\n");
 	fprintf(stderr, "  -S                    perform SRAM programming\n");
+	fprintf(stderr, "      --verify-crc      with -S, compare the device's frame CRC with the\n");
+	fprintf(stderr, "                          CRC of the bitstream\n");
+	fprintf(stderr, "      --skip-same       with -S, don't reload if the device is configured\n");
+	fprintf(stderr, "                          (DONE) and its USERCODE matches the bitstream's\n");
+	fprintf(stderr, "      --usercode <n>    with --skip-same, expect this USERCODE instead\n");
+	fprintf(stderr, "      --watch           with -S, stay connected and reload whenever the\n");
+	fprintf(stderr, "                          input file is rewritten\n");
+	fprintf(stderr, "      --upload <file>@<addr>\n");
+	fprintf(stderr, "                        with -S, upload a file through the user JTAG\n");
+	fprintf(stderr, "                          registers after loading and run it at <addr>\n");
 	fprintf(stderr, "  -t                    just read the flash ID sequence\n");
 	fprintf(stderr, "  -W                    write byte to custom JTAG logic for test purposes\n");
 	fprintf(stderr, "  -D <port nr>          run in daemon / server mode\n");
@@ -990,11 +2817,41 @@ static void help(const char *progname)
 	fprintf(stderr, "  -b                    bulk erase entire flash before writing\n");
 	fprintf(stderr, "  -e <size in bytes>    erase flash as if we were writing that number of bytes\n");
 	fprintf(stderr, "  -n                    do not erase flash before writing\n");
+	fprintf(stderr, "      --repair <n>      when verify fails, re-erase and reprogram just the 4kB\n");
+	fprintf(stderr, "                          sectors that differ, up to <n> times\n");
+	fprintf(stderr, "      --slots <a>,<b>   program into whichever of the two slot offsets isn't\n");
+	fprintf(stderr, "                          booted, then point the jump header at 0 to it\n");
+	fprintf(stderr, "      --slot-status     with --slots, show which slot boots and what it holds\n");
+	fprintf(stderr, "      --slot-switch     with --slots, boot the other slot (rollback)\n");
+	fprintf(stderr, "      --in-place        read back each erase block first and program it without\n");
+	fprintf(stderr, "                          an erase if the update only clears bits\n");
 	fprintf(stderr, "  -p                    disable write protection before erasing or writing\n");
 	fprintf(stderr, "                          This can be useful if flash memory appears to be\n");
 	fprintf(stderr, "                          bricked and won't respond to erasing or programming.\n");
+	fprintf(stderr, "      --board-cache     skip erase blocks this board is known to hold already\n");
+	fprintf(stderr, "                          Hashes of verified flash contents are kept per FPGA\n");
+	fprintf(stderr, "                          unique ID in the ecpprog cache directory.\n");
+	fprintf(stderr, "      --spot-check <n>  with --board-cache, read back <n> skipped sectors\n");
+	fprintf(stderr, "                          to detect flash changed by other tools [default: 0]\n");
+	fprintf(stderr, "      --flash-index <offset>\n");
+	fprintf(stderr, "                        like --board-cache, but keep the hashes in the 64kB\n");
+	fprintf(stderr, "                          of flash at <offset>, so they work from any host\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Miscellaneous options:\n");
+	fprintf(stderr, "      --report json[:<file>]\n");
+	fprintf(stderr, "                        at exit, write the time and throughput of each phase,\n");
+	fprintf(stderr, "                          the clock divider and the devices found as a line\n");
+	fprintf(stderr, "                          of JSON to <file> [default: stdout]\n");
+	fprintf(stderr, "      --stats           at exit, show USB transfers, round trips, time spent\n");
+	fprintf(stderr, "                          waiting on the adapter and JTAG scan counts\n");
+	fprintf(stderr, "      --trace <file>    write a timeline of operations, JTAG scans and USB\n");
+	fprintf(stderr, "                          transfers in Chrome trace format (chrome://tracing,\n");
+	fprintf(stderr, "                          Perfetto)\n");
+	fprintf(stderr, "      --dry-run[=<jedec id>]\n");
+	fprintf(stderr, "                        don't access the hardware, estimate the USB traffic,\n");
+	fprintf(stderr, "                          round trips and time of each phase instead, for the\n");
+	fprintf(stderr, "                          flash with that JEDEC ID in the SFDP cache\n");
+	fprintf(stderr, "                          [default: 256 byte pages, typical timings]\n");
 	fprintf(stderr, "      --help            display this help and exit\n");
 	fprintf(stderr, "  --                    treat all remaining arguments as filenames\n");
 	fprintf(stderr, "\n");
@@ -1010,6 +2867,188 @@ static void help(const char *progname)
 	fprintf(stderr, "  https://github.com/gregdavill/ecpprog/issues\n");
 }
 
+/* Ends a pass over compressed input, which must decompress to exactly
+ * 'size' bytes unless 'size' is negative */
+static int decompress_finish(struct decompress *d, long size)
+{
+	bool extra = size >= 0 && getc(decompress_stream(d)) != EOF;
+	long produced = decompress_close(d);
+
+	if (extra || (produced >= 0 && size >= 0 && produced != size)) {
+		fprintf(stderr, "decompressed size does not match the size in the header\n");
+		return EXIT_FAILURE;
+	}
+	if (produced < 0) {
+		fprintf(stderr, "compressed input is corrupt or truncated\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* What to do after each SRAM load: -W and --upload */
+struct sram_action {
+	bool        set_io;
+	int         io_value;
+	const char *upload;
+	uint32_t    upload_addr;
+};
+
+static void sram_action_run(const struct sram_action *action)
+{
+	if (action->set_io)
+		user_set_io(action->io_value);
+	if (action->upload && user_upload(action->upload, action->upload_addr) == 0)
+		user_run_appl(action->upload_addr);
+}
+
+static int sram_load_file(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "can't open '%s' for reading: ", filename);
+		perror(0);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t magic[DECOMPRESS_MAGIC_LEN];
+	size_t magic_len = fread(magic, 1, sizeof(magic), f);
+	rewind(f);
+
+	int ret;
+	if (decompress_detect(magic, magic_len)) {
+		struct decompress *compressed = decompress_open(f, NULL, 0);
+		if (compressed == NULL) {
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+		ret = ecp_prog_sram(decompress_stream(compressed), verbose);
+		if (!ret)
+			ret = decompress_finish(compressed, -1);
+		else
+			decompress_close(compressed);
+	} else {
+		ret = ecp_prog_sram(f, verbose);
+	}
+	fclose(f);
+	return ret;
+}
+
+/* Progress goes to the terminal and into the timing report */
+static void show_progress(const struct progress *p)
+{
+	progress_print(p);
+	report_progress(p);
+}
+
+static void write_report()
+{
+	report_info.idcode = connected_device.id;
+	report_info.device = connected_device.name;
+	report_info.unique_id = board_unique_id;
+	report_info.jedec_id = flash.jedec_id;
+	report_info.flash_size = flash.size;
+	if (report_write(report_path, &report_info))
+		fprintf(stderr, "can't write the report to '%s'\n", report_path ? report_path : "stdout");
+}
+
+static void print_stats()
+{
+	fprintf(stderr, "USB: %" PRIu64 " writes (%" PRIu64 " bytes), %" PRIu64 " reads (%" PRIu64 " bytes), "
+		"%" PRIu64 " round trips, %.3f s blocked\n",
+		mpsse_stats.usb_writes, mpsse_stats.bytes_out, mpsse_stats.usb_reads, mpsse_stats.bytes_in,
+		mpsse_stats.round_trips, mpsse_stats.blocked);
+	fprintf(stderr, "JTAG: %" PRIu64 " TMS transitions in %" PRIu64 " TMS commands, %" PRIu64 " IR scans, %" PRIu64 " DR scans\n",
+		jtag_stats.tms_transitions, jtag_stats.tms_commands, jtag_stats.ir_scans, jtag_stats.dr_scans);
+	fprintf(stderr, "JTAG: %" PRIu64 " bit mode and %" PRIu64 " byte mode scan commands\n",
+		jtag_stats.bit_commands, jtag_stats.byte_commands);
+}
+
+/* Reloads the SRAM each time 'filename' is rewritten. The adapter stays
+ * open, so a cycle costs only the bitstream transfer. */
+static void sram_watch(const char *filename, const struct sram_action *action)
+{
+	struct watch *w = watch_open(filename);
+	if (w == NULL) {
+		fprintf(stderr, "can't watch '%s': ", filename);
+		perror(0);
+		jtag_error(EXIT_FAILURE);
+	}
+
+	while (1) {
+		fprintf(stderr, "watching '%s'..\n", filename);
+		if (watch_wait(w)) {
+			perror("watch");
+			break;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		int ret = sram_load_file(filename);
+		if (!ret)
+			sram_action_run(action);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+		if (ret)
+			fprintf(stderr, "load failed after %ld ms\n", ms);
+		else
+			fprintf(stderr, "reloaded in %ld ms\n", ms);
+	}
+	watch_close(w);
+}
+
+/* Reads all of the seekable 'f' to look at its bitstream structure */
+static int read_bitstream_info(FILE *f, struct bitstream_info *info)
+{
+	long size;
+	if (fseek(f, 0L, SEEK_END) == -1 || (size = ftell(f)) <= 0 || fseek(f, 0L, SEEK_SET) == -1)
+		return -1;
+
+	uint8_t *data = malloc(size);
+	if (!data)
+		return -1;
+
+	int rc = -1;
+	if (fread(data, 1, size, f) == (size_t)size)
+		rc = bitstream_parse(data, size, info);
+	free(data);
+	fseek(f, 0L, SEEK_SET);
+	return rc;
+}
+
+/* Copies 'prefix' and the rest of 'in' into a temporary file */
+static FILE *spool_to_tmpfile(FILE *in, const uint8_t *prefix, size_t prefix_len, long *size)
+{
+	FILE *f = tmpfile();
+	if (f == NULL)
+		return NULL;
+
+	*size = prefix_len;
+	if (prefix_len && fwrite(prefix, 1, prefix_len, f) != prefix_len) {
+		fclose(f);
+		return NULL;
+	}
+
+	while (true) {
+		static unsigned char buffer[4096];
+		size_t rc = fread(buffer, 1, 4096, in);
+		if (rc <= 0)
+			break;
+		size_t wc = fwrite(buffer, 1, rc, f);
+		if (wc != rc) {
+			fclose(f);
+			return NULL;
+		}
+		*size += rc;
+	}
+
+	/* now seek to the beginning so we can
+	   start reading again */
+	fseek(f, 0, SEEK_SET);
+	return f;
+}
+
 int main(int argc, char **argv)
 {
 	/* used for error reporting */
@@ -1018,10 +3057,10 @@ int main(int argc, char **argv)
 		if (argv[0][i] == '/')
 			my_name = argv[0] + i + 1;
 
-	int read_size = 256 * 1024;
+	uint64_t read_size = 256 * 1024;
 	int erase_block_size = 64;
-	int erase_size = 0;
-	int rw_offset = 0;
+	uint64_t erase_size = 0;
+	uint64_t rw_offset = 0;
 	int clkdiv = 1;
 	int writebyte = 0;
 	int portnr = 0;
@@ -1030,14 +3069,33 @@ int main(int argc, char **argv)
 	bool user_mode = false;
 	bool reinitialize = false;
 	bool read_mode = false;
+	bool read_size_set = false;
+	bool hash_mode = false;
+	bool hash_stop_at_end = false;
+	bool sparse_output = false;
+	bool trim_output = false;
+	bool manifest_mode = false;
+	bool image_mode = false;
+	struct image image = { NULL, 0 };
 	bool check_mode = false;
 	bool erase_mode = false;
 	bool bulk_erase = false;
 	bool dont_erase = false;
 	bool prog_sram = false;
+	bool sram_skip_same = false;
+	bool sram_usercode_set = false;
+	uint32_t sram_usercode = 0;
+	bool watch_mode = false;
+	struct sram_action sram_action = {0};
 	bool test_mode = false;
 	bool disable_protect = false;
 	bool disable_verify = false;
+	bool slot_status = false;
+	bool slot_switch_mode = false;
+	int slot_target = -1;
+	bool stats_enabled = false;
+	const char *trace_path = NULL;
+	bool dry_run = false;
 
 	const char *filename = NULL;
 	const char *devstr = NULL;
@@ -1050,13 +3108,36 @@ int main(int argc, char **argv)
 
 	static struct option long_options[] = {
 		{"help", no_argument, NULL, -2},
+		{"board-cache", no_argument, NULL, -3},
+		{"spot-check", required_argument, NULL, -4},
+		{"bitstream-end", no_argument, NULL, -5},
+		{"sparse", no_argument, NULL, -6},
+		{"trim", no_argument, NULL, -7},
+		{"manifest", no_argument, NULL, -8},
+		{"verify-crc", no_argument, NULL, -9},
+		{"skip-same", no_argument, NULL, -10},
+		{"usercode", required_argument, NULL, -11},
+		{"watch", no_argument, NULL, -12},
+		{"upload", required_argument, NULL, -13},
+		{"bridge", required_argument, NULL, -14},
+		{"resume", no_argument, NULL, -15},
+		{"flash-index", required_argument, NULL, -16},
+		{"in-place", no_argument, NULL, -17},
+		{"slots", required_argument, NULL, -18},
+		{"slot-status", no_argument, NULL, -19},
+		{"slot-switch", no_argument, NULL, -20},
+		{"repair", required_argument, NULL, -21},
+		{"report", required_argument, NULL, -22},
+		{"stats", no_argument, NULL, -23},
+		{"trace", required_argument, NULL, -24},
+		{"dry-run", optional_argument, NULL, -25},
 		{NULL, 0, NULL, 0}
 	};
 
 	/* Decode command line parameters */
 	int opt;
 	char *endptr;
-	while ((opt = getopt_long(argc, argv, "W:D:d:i:I:rR:e:o:k:scabnStvpX", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "W:D:d:i:I:rR:e:o:k:scabnStvpXH", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'W': /* write to user JTAG */
 			writebyte = strtol(optarg, NULL, 0);
@@ -1098,43 +3179,27 @@ int main(int argc, char **argv)
 		case 'r': /* Read 256 bytes to file */
 			read_mode = true;
 			break;
+		case 'H': /* Hash flash contents */
+			read_mode = true;
+			hash_mode = true;
+			break;
 		case 'R': /* Read n bytes to file */
 			read_mode = true;
-			read_size = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				read_size *= 1024;
-			else if (!strcmp(endptr, "M"))
-				read_size *= 1024 * 1024;
-			else {
+			read_size_set = true;
+			if (!parse_size(optarg, &read_size)) {
 				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
 				return EXIT_FAILURE;
 			}
 			break;
 		case 'e': /* Erase blocks as if we were writing n bytes */
 			erase_mode = true;
-			erase_size = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				erase_size *= 1024;
-			else if (!strcmp(endptr, "M"))
-				erase_size *= 1024 * 1024;
-			else {
+			if (!parse_size(optarg, &erase_size)) {
 				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
 				return EXIT_FAILURE;
 			}
 			break;
 		case 'o': /* set address offset */
-			rw_offset = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				rw_offset *= 1024;
-			else if (!strcmp(endptr, "M"))
-				rw_offset *= 1024 * 1024;
-			else {
+			if (!parse_size(optarg, &rw_offset)) {
 				fprintf(stderr, "%s: `%s' is not a valid offset\n", my_name, optarg);
 				return EXIT_FAILURE;
 			}
@@ -1179,6 +3244,138 @@ int main(int argc, char **argv)
 		case -2:
 			help(argv[0]);
 			return EXIT_SUCCESS;
+		case -5: /* stop hashing at the end of the bitstream */
+			hash_stop_at_end = true;
+			break;
+		case -6: /* leave erased runs out of the readback */
+			sparse_output = true;
+			break;
+		case -7: /* end the readback at the last programmed byte */
+			trim_output = true;
+			break;
+		case -8: /* input file lists several images */
+			manifest_mode = true;
+			break;
+		case -9: /* check the frame CRC after SRAM programming */
+			sram_crc_check = true;
+			break;
+		case -10: /* don't reload a design that is already running */
+			sram_skip_same = true;
+			break;
+		case -11: /* USERCODE to expect instead of the bitstream's */
+			sram_usercode = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0') {
+				fprintf(stderr, "%s: `%s' is not a valid USERCODE\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			sram_usercode_set = true;
+			break;
+		case -12: /* reload SRAM when the file changes */
+			watch_mode = true;
+			break;
+		case -13: /* file to run on the loaded design, <file>@<addr> */
+		{
+			char *at = strrchr(optarg, '@');
+			if (at && at != optarg && at[1] != '\0') {
+				sram_action.upload_addr = strtoul(at + 1, &endptr, 0);
+				if (*endptr == '\0') {
+					*at = '\0';
+					sram_action.upload = optarg;
+					break;
+				}
+			}
+			fprintf(stderr, "%s: `%s' is not a valid <file>@<address>\n", my_name, optarg);
+			return EXIT_FAILURE;
+		}
+		case -14: /* SPI bridge bitstream */
+			bridge_path = optarg;
+			break;
+		case -15: /* continue an interrupted run */
+			journal_resume = true;
+			break;
+		case -16: /* keep the board cache in flash */
+			flash_index = true;
+			if (!parse_size(optarg, &flash_index_addr)) {
+				fprintf(stderr, "%s: `%s' is not a valid offset\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			if (flash_index_addr % BOARD_CACHE_SECTOR) {
+				fprintf(stderr, "%s: flash index offset must be a multiple of 4kB\n", my_name);
+				return EXIT_FAILURE;
+			}
+			break;
+		case -17: /* program without erase where only bits are cleared */
+			in_place_enabled = true;
+			break;
+		case -18: /* A/B slot offsets, <a>,<b> */
+		{
+			bool valid = false;
+			slot_addr[0] = strtoul(optarg, &endptr, 0);
+			if (endptr != optarg && *endptr == ',') {
+				slot_addr[1] = strtoul(endptr + 1, &endptr, 0);
+				valid = *endptr == '\0' && slot_addr[0] != slot_addr[1];
+			}
+			if (!valid) {
+				fprintf(stderr, "%s: `%s' is not a valid pair of slot offsets\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			for (int i = 0; i < 2; i++) {
+				if (slot_addr[i] < SLOT_HEADER_SIZE || slot_addr[i] % SLOT_HEADER_SIZE || slot_addr[i] >= (1 << 24)) {
+					fprintf(stderr, "%s: slot offsets must be multiples of 4kB between 4kB and 16MB\n", my_name);
+					return EXIT_FAILURE;
+				}
+			}
+			slots_enabled = true;
+			break;
+		}
+		case -19: /* show the A/B slots */
+			slot_status = true;
+			break;
+		case -20: /* boot the other A/B slot */
+			slot_switch_mode = true;
+			break;
+		case -21: /* rounds of reprogramming sectors that fail verify */
+			repair_rounds = strtol(optarg, &endptr, 0);
+			if (*endptr != '\0' || repair_rounds < 0) {
+				fprintf(stderr, "%s: `%s' is not a valid number\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case -22: /* timing report at exit */
+			if (!strncmp(optarg, "json:", 5) && optarg[5]) {
+				report_path = optarg + 5;
+			} else if (strcmp(optarg, "json")) {
+				fprintf(stderr, "%s: `%s' is not a valid report, use json or json:<file>\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			report_enabled = true;
+			break;
+		case -23: /* transport counters at exit */
+			stats_enabled = true;
+			break;
+		case -24: /* timeline of the run */
+			trace_path = optarg;
+			break;
+		case -25: /* estimate the run instead, optionally for a given flash */
+			if (optarg) {
+				dry_run_jedec_id = strtoul(optarg, &endptr, 16);
+				if (*endptr != '\0' || dry_run_jedec_id > 0xFFFFFF) {
+					fprintf(stderr, "%s: `%s' is not a valid JEDEC ID\n", my_name, optarg);
+					return EXIT_FAILURE;
+				}
+			}
+			dry_run = true;
+			break;
+		case -3: /* skip blocks recorded as programmed */
+			board_cache_enabled = true;
+			break;
+		case -4: /* sectors to read back when skipping */
+			board_spot_checks = strtol(optarg, &endptr, 0);
+			if (*endptr != '\0' || board_spot_checks < 0) {
+				fprintf(stderr, "%s: `%s' is not a valid number\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		default:
 			/* error message has already been printed */
 			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
@@ -1189,7 +3386,22 @@ int main(int argc, char **argv)
 	/* Make sure that the combination of provided parameters makes sense */
 
 	if (read_mode + erase_mode + check_mode + prog_sram + test_mode + daemon_mode > 1) {
-		fprintf(stderr, "%s: options `-r'/`-R', `-e`, `-c', `-S', `-D', and `-t' are mutually exclusive\n", my_name);
+		fprintf(stderr, "%s: options `-r'/`-R'/`-H', `-e`, `-c', `-S', `-D', and `-t' are mutually exclusive\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (manifest_mode && (read_mode || erase_mode || prog_sram || test_mode || daemon_mode)) {
+		fprintf(stderr, "%s: option `--manifest' only valid in programming and check mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if ((sparse_output || trim_output) && (!read_mode || hash_mode)) {
+		fprintf(stderr, "%s: options `--sparse' and `--trim' only valid with `-r'/`-R'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (hash_stop_at_end && !hash_mode) {
+		fprintf(stderr, "%s: option `--bitstream-end' only valid with `-H'\n", my_name);
 		return EXIT_FAILURE;
 	}
 
@@ -1213,6 +3425,88 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (sram_crc_check && !prog_sram) {
+		fprintf(stderr, "%s: option `--verify-crc' only valid with `-S'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if ((sram_skip_same || sram_usercode_set) && !prog_sram) {
+		fprintf(stderr, "%s: options `--skip-same' and `--usercode' only valid with `-S'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if ((watch_mode || sram_action.upload) && !prog_sram) {
+		fprintf(stderr, "%s: options `--watch' and `--upload' only valid with `-S'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (journal_resume && (read_mode || erase_mode || check_mode || prog_sram || test_mode || daemon_mode || bulk_erase || dont_erase)) {
+		fprintf(stderr, "%s: option `--resume' only valid in programming mode with block erase\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (in_place_enabled && (read_mode || erase_mode || check_mode || prog_sram || test_mode || daemon_mode || bulk_erase || dont_erase)) {
+		fprintf(stderr, "%s: option `--in-place' only valid in programming mode with block erase\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (repair_rounds && (read_mode || erase_mode || check_mode || prog_sram || test_mode || daemon_mode || disable_verify)) {
+		fprintf(stderr, "%s: option `--repair' only valid in programming mode with verification\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if ((slot_status || slot_switch_mode) && !slots_enabled) {
+		fprintf(stderr, "%s: options `--slot-status' and `--slot-switch' need `--slots'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if ((slot_status || slot_switch_mode) &&
+	    (slot_status + slot_switch_mode + read_mode + erase_mode + check_mode + prog_sram + test_mode + daemon_mode > 1)) {
+		fprintf(stderr, "%s: options `--slot-status' and `--slot-switch' can't be combined with other modes\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (slots_enabled && (read_mode || erase_mode || check_mode || prog_sram || test_mode || daemon_mode || manifest_mode || rw_offset != 0)) {
+		fprintf(stderr, "%s: option `--slots' only valid in programming mode, without `-o'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (slots_enabled && disable_verify) {
+		fprintf(stderr, "%s: option `--slots' switches slots only after verification, it can't be combined with `-X'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (flash_index && (prog_sram || test_mode || daemon_mode)) {
+		fprintf(stderr, "%s: option `--flash-index' only valid with flash access\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (bridge_path && (prog_sram || test_mode || daemon_mode)) {
+		fprintf(stderr, "%s: option `--bridge' only valid with flash access\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (bridge_path && access(bridge_path, R_OK) != 0) {
+		fprintf(stderr, "%s: can't open '%s' for reading: ", my_name, bridge_path);
+		perror(0);
+		return EXIT_FAILURE;
+	}
+
+	if (dry_run && (prog_sram || test_mode || daemon_mode || user_mode || slot_status || slot_switch_mode)) {
+		fprintf(stderr, "%s: option `--dry-run' only valid for flash programming, erase, check and read\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (dry_run && (board_cache_enabled || flash_index || in_place_enabled || journal_resume || slots_enabled || bridge_path)) {
+		fprintf(stderr, "%s: option `--dry-run' can't model options that depend on the flash contents or a bridge\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (dry_run && (report_enabled || stats_enabled || trace_path)) {
+		fprintf(stderr, "%s: options `--report', `--stats' and `--trace' measure real runs, not `--dry-run'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
 	if (rw_offset != 0 && prog_sram) {
 		fprintf(stderr, "%s: option `-o' not supported in SRAM mode\n", my_name);
 		return EXIT_FAILURE;
@@ -1224,16 +3518,22 @@ int main(int argc, char **argv)
 	}
 
 	if (optind + 1 == argc) {
-		if (test_mode) {
-			fprintf(stderr, "%s: test mode doesn't take a file name\n", my_name);
+		if (test_mode || slot_status || slot_switch_mode) {
+			fprintf(stderr, "%s: %s doesn't take a file name\n", my_name, test_mode ? "test mode" : "slot mode");
 			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
 			return EXIT_FAILURE;
 		}
 		filename = argv[optind];
+		if (watch_mode && strcmp(filename, "-") == 0) {
+			fprintf(stderr, "%s: option `--watch' needs a file name\n", my_name);
+			return EXIT_FAILURE;
+		}
 	} else if (optind != argc) {
 		fprintf(stderr, "%s: too many arguments\n", my_name);
 		fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
 		return EXIT_FAILURE;
+	} else if (slot_status || slot_switch_mode) {
+		/* nop */;
 	} else if (bulk_erase || disable_protect) {
 		filename = "/dev/null";
 	} else if (!test_mode && !erase_mode && !disable_protect & !user_mode & !daemon_mode) {
@@ -1246,8 +3546,17 @@ int main(int argc, char **argv)
 	   so we can fail before initializing the hardware */
 
 	FILE *f = NULL;
+	FILE *compressed_input = NULL;
+	struct decompress *compressed = NULL;
 	long file_size = -1;
 
+	/* Pipes are programmed as the data arrives, unless the whole image is
+	   needed up front (SRAM, check only, board cache, journal, sparse input) */
+	bool can_stream = !prog_sram && !check_mode && !board_cache_enabled && !flash_index && !in_place_enabled && !journal_resume && !slots_enabled && !dry_run;
+	bool stream_input = false;
+	uint8_t stream_prefix[8];
+	size_t stream_prefix_len = 0;
+
 	if (test_mode) {
 		/* nop */;
 	} else if (daemon_mode) {
@@ -1255,13 +3564,34 @@ int main(int argc, char **argv)
 	} else if (erase_mode) {
 		file_size = erase_size;
 	} else if (read_mode) {
-		f = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "wb");
-		if (f == NULL) {
-			fprintf(stderr, "%s: can't open '%s' for writing: ", my_name, filename);
-			perror(0);
-			return EXIT_FAILURE;
+		/* A dry run has nothing to write */
+		if (!dry_run) {
+			f = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "wb");
+			if (f == NULL) {
+				fprintf(stderr, "%s: can't open '%s' for writing: ", my_name, filename);
+				perror(0);
+				return EXIT_FAILURE;
+			}
 		}
 		file_size = read_size;
+	} else if (filename && !prog_sram && !user_mode && strcmp(filename, "-") != 0 &&
+	           (manifest_mode || image_is_segmented(filename))) {
+		/* Manifest, Intel HEX or ELF: several segments in one session */
+		if (slots_enabled) {
+			fprintf(stderr, "%s: %s: option `--slots' takes a single image\n", my_name, filename);
+			return EXIT_FAILURE;
+		}
+		if (journal_resume) {
+			fprintf(stderr, "%s: %s: option `--resume' takes a single image\n", my_name, filename);
+			return EXIT_FAILURE;
+		}
+		if (in_place_enabled) {
+			fprintf(stderr, "%s: %s: option `--in-place' takes a single image\n", my_name, filename);
+			return EXIT_FAILURE;
+		}
+		if (image_load(&image, filename, rw_offset, manifest_mode))
+			return EXIT_FAILURE;
+		image_mode = true;
 	} else if (filename) {
 		f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
 		if (f == NULL) {
@@ -1280,7 +3610,59 @@ int main(int argc, char **argv)
 		   named pipe, or contrarily, the standard input may be an
 		   ordinary file. */
 
-		if (!prog_sram) {
+		/* gzip and zstd input is decompressed on its own thread. SRAM
+		   programming reads it once, front to back. Flash programming
+		   streams it too when the header gives the decompressed size
+		   and the input can be rewound for verification, unless a
+		   journal, slot header or --in-place needs a copy it can
+		   seek in. */
+
+		int c = getc(f);
+		if (c != EOF && ungetc(c, f) != EOF && decompress_detect((uint8_t[]){ c }, 1)) {
+			uint8_t magic[DECOMPRESS_MAGIC_LEN];
+			size_t magic_len = fread(magic, 1, sizeof(magic), f);
+			bool seekable = fseek(f, 0L, SEEK_SET) != -1;
+
+			if (decompress_detect(magic, magic_len)) {
+				compressed = decompress_open(f, seekable ? NULL : magic, seekable ? 0 : magic_len);
+				if (compressed == NULL) {
+					fprintf(stderr, "%s: %s: can't start decompression\n", my_name, filename);
+					return EXIT_FAILURE;
+				}
+				compressed_input = f;
+				file_size = decompress_size_hint(compressed);
+				f = decompress_stream(compressed);
+
+				if (can_stream && (!seekable || file_size < 0)) {
+					stream_input = true;
+				} else if (!prog_sram && (!seekable || file_size < 0 || slots_enabled || journal_resume || in_place_enabled)) {
+					FILE *copy = spool_to_tmpfile(f, NULL, 0, &file_size);
+					if (decompress_close(compressed) < 0 || copy == NULL) {
+						fprintf(stderr, "%s: %s: can't decompress\n", my_name, filename);
+						return EXIT_FAILURE;
+					}
+					compressed = NULL;
+					fclose(compressed_input);
+					compressed_input = NULL;
+					f = copy;
+				}
+			} else if (!seekable && can_stream) {
+				/* Not compressed after all, but the magic is consumed */
+				memcpy(stream_prefix, magic, magic_len);
+				stream_prefix_len = magic_len;
+				stream_input = true;
+			} else if (!seekable) {
+				FILE *pipe = f;
+				f = spool_to_tmpfile(pipe, magic, magic_len, &file_size);
+				fclose(pipe);
+				if (f == NULL) {
+					fprintf(stderr, "%s: can't write to temporary file\n", my_name);
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		if (!prog_sram && !compressed && !stream_input) {
 			if (fseek(f, 0L, SEEK_END) != -1) {
 				file_size = ftell(f);
 				if (file_size == -1) {
@@ -1294,33 +3676,68 @@ int main(int argc, char **argv)
 					return EXIT_FAILURE;
 				}
 			} else {
-				FILE *pipe = f;
-
-				f = tmpfile();
-				if (f == NULL) {
-					fprintf(stderr, "%s: can't open temporary file\n", my_name);
-					return EXIT_FAILURE;
-				}
-				file_size = 0;
-
-				while (true) {
-					static unsigned char buffer[4096];
-					size_t rc = fread(buffer, 1, 4096, pipe);
-					if (rc <= 0)
-						break;
-					size_t wc = fwrite(buffer, 1, rc, f);
-					if (wc != rc) {
+				if (can_stream)
+					stream_prefix_len = fread(stream_prefix, 1, sizeof(stream_prefix), f);
+				if (can_stream && (stream_prefix_len != sizeof(stream_prefix) ||
+				                   memcmp(stream_prefix, SPARSE_MAGIC, sizeof(stream_prefix)))) {
+					stream_input = true;
+				} else {
+					FILE *pipe = f;
+					f = spool_to_tmpfile(pipe, stream_prefix, stream_prefix_len, &file_size);
+					fclose(pipe);
+					if (f == NULL) {
 						fprintf(stderr, "%s: can't write to temporary file\n", my_name);
 						return EXIT_FAILURE;
 					}
-					file_size += rc;
 				}
-				fclose(pipe);
+			}
+
+			/* Images saved with -r --sparse are expanded to plain binaries */
+			if (!stream_input && sparse_detect(f)) {
+				FILE *image = sparse_expand(f, &file_size);
+				if (image == NULL) {
+					fprintf(stderr, "%s: %s: can't expand sparse image\n", my_name, filename);
+					return EXIT_FAILURE;
+				}
+				fclose(f);
+				f = image;
+			}
+		}
+	}
 
-				/* now seek to the beginning so we can
-				   start reading again */
-				fseek(f, 0, SEEK_SET);
+	/* The USERCODE comes after the configuration frames, so --skip-same
+	   reads the whole bitstream before anything is loaded */
+	if (sram_skip_same && !sram_usercode_set) {
+		if (compressed || fseek(f, 0L, SEEK_SET) == -1) {
+			FILE *copy = spool_to_tmpfile(f, NULL, 0, &file_size);
+			if (compressed) {
+				if (decompress_finish(compressed, -1))
+					return EXIT_FAILURE;
+				compressed = NULL;
+			} else if (f != stdin) {
+				fclose(f);
 			}
+			f = copy;
+			if (f == NULL) {
+				fprintf(stderr, "%s: can't write to temporary file\n", my_name);
+				return EXIT_FAILURE;
+			}
+		}
+
+		struct bitstream_info info;
+		if (read_bitstream_info(f, &info)) {
+			fprintf(stderr, "%s: %s: not a bitstream\n", my_name, filename);
+			return EXIT_FAILURE;
+		}
+		if (!info.has_usercode) {
+			fprintf(stderr, "%s: %s: no USERCODE in bitstream, will always load\n", my_name, filename);
+			sram_skip_same = false;
+		} else if (info.usercode == 0 || info.usercode == 0xFFFFFFFF) {
+			/* The default USERCODE doesn't tell designs apart */
+			fprintf(stderr, "%s: %s: USERCODE 0x%08X is the default, will always load\n", my_name, filename, info.usercode);
+			sram_skip_same = false;
+		} else {
+			sram_usercode = info.usercode;
 		}
 	}
 
@@ -1328,12 +3745,47 @@ int main(int argc, char **argv)
 	// Initialize USB connection to FT2232H
 	// ---------------------------------------------------------
 
+	if (report_enabled) {
+		report_info.start = report_time();
+		report_info.clkdiv = clkdiv;
+		atexit(write_report);
+	}
+	if (stats_enabled)
+		atexit(print_stats);
+	if (trace_path && trace_open(trace_path)) {
+		fprintf(stderr, "%s: can't open '%s' for writing: ", my_name, trace_path);
+		perror(0);
+		return EXIT_FAILURE;
+	}
+
+	if (dry_run) {
+		fprintf(stderr, "dry run, nothing is sent to the adapter\n");
+		dryrun_start(clkdiv);
+	}
+
 	fprintf(stderr, "init..\n");
+	double phase_start = report_time();
+	trace_begin("usb init");
 	jtag_init(ifnum, devstr, clkdiv);
+	trace_end();
+	report_add(REPORT_USB_INIT, phase_start, 0);
+	progress_listen(dry_run ? dryrun_progress : show_progress);
+
+	/* The model has no device to identify */
+	uint64_t status = 0;
+	if (!dry_run) {
+		phase_start = report_time();
+		trace_begin("identify");
+		read_idcode();
+		read_unique_id();
+		status = read_status_register();
+		trace_end();
+		report_add(REPORT_IDENTIFY, phase_start, 0);
+	}
 
-	read_idcode();
-	read_unique_id();
-	read_status_register();
+	/* Seeded once for the board cache spot checks, which differ between
+	   runs in the same second and between boards */
+	srand(time(NULL) ^ getpid() ^ board_unique_id ^ (board_unique_id >> 32));
 
 	if (daemon_mode)
 	{
@@ -1356,35 +3808,159 @@ int main(int argc, char **argv)
 		enter_spi_background_mode();
 
 		flash_reset();
-		flash_read_id();
+		flash_probe(flash_read_id());
 
 		flash_read_status();
 	}
 	else if (prog_sram)
 	{
-		ecp_prog_sram(f, verbose);
+		uint32_t usercode;
 
-		if (user_mode)
-		{
-			user_set_io(writebyte);
+		if (sram_skip_same && (status & (1 << 8)) && (usercode = read_usercode()) == sram_usercode) {
+			fprintf(stderr, "USERCODE 0x%08X already loaded, skipping\n", usercode);
+		} else {
+			int ret = ecp_prog_sram(f, verbose);
+
+			if (compressed) {
+				if (!ret)
+					ret = decompress_finish(compressed, -1);
+				else
+					decompress_close(compressed);
+				compressed = NULL;
+				f = NULL;
+			}
+			if (ret)
+				jtag_error(ret);
 		}
+
+		sram_action.set_io = user_mode;
+		sram_action.io_value = writebyte;
+		sram_action_run(&sram_action);
+
+		if (watch_mode)
+			sram_watch(filename, &sram_action);
+	}
+	else if (slot_status || slot_switch_mode)
+	{
+		ecp_init_flash_mode();
+
+		int ret = slot_read_header();
+		if (!ret && slot_switch_mode)
+			ret = slot_switch();
+		if (!ret)
+			slot_print_status();
+		if (ret)
+			flash_error(ret);
+
+		ecp_exit_flash_mode();
 	}
 	else /* program flash */
 	{
+		/* A bitstream for another device is refused before the FPGA
+		   is reset. Streamed input isn't looked at ahead of time. */
+		if (f && !read_mode && !check_mode && !hash_mode && !erase_mode && !stream_input && !compressed && !dry_run)
+			flash_check_bitstream(f);
+
 		// ---------------------------------------------------------
 		// Reset
 		// ---------------------------------------------------------
 		ecp_init_flash_mode();
 
+		/* The image goes to the slot that doesn't boot */
+		if (slots_enabled) {
+			if (slot_read_header())
+				flash_error(EXIT_FAILURE);
+			slot_target = (slot_header.active == 0) ? 1 : 0;
+			rw_offset = slot_addr[slot_target];
+
+			uint32_t other = slot_addr[!slot_target];
+			if (other > rw_offset && rw_offset + file_size > other) {
+				fprintf(stderr, "%s: %ld bytes don't fit slot %c\n", my_name, file_size, 'A' + slot_target);
+				flash_error(EXIT_FAILURE);
+			}
+			fprintf(stderr, "programming slot %c at 0x%06" PRIX64 "\n", 'A' + slot_target, rw_offset);
+		}
+
+		/* Without -R, hash everything from the offset to the end of the flash */
+		if (hash_mode && !read_size_set && flash.size > rw_offset)
+			file_size = read_size = flash.size - rw_offset;
+
+		if (flash.size && file_size > 0 && rw_offset + file_size > flash.size) {
+			fprintf(stderr, "%s: 0x%" PRIX64 " + %ld bytes exceeds the %" PRIu64 " MB flash\n",
+				my_name, rw_offset, file_size, flash.size >> 20);
+			flash_error(EXIT_FAILURE);
+		}
+
+		for (unsigned i = 0; i < image.count; i++) {
+			const struct image_segment *s = &image.segments[i];
+			if (flash.size && s->addr + s->size > flash.size) {
+				fprintf(stderr, "%s: %s: 0x%" PRIX64 " + %ld bytes exceeds the %" PRIu64 " MB flash\n",
+					my_name, s->source, s->addr, s->size, flash.size >> 20);
+				flash_error(EXIT_FAILURE);
+			}
+		}
+
 		// ---------------------------------------------------------
 		// Program
 		// ---------------------------------------------------------
 
-		if (!read_mode && !check_mode)
+		if (image_mode && !check_mode)
+		{
+			int ret = ecp_prog_image(&image, disable_protect, dont_erase, bulk_erase, erase_block_size);
+			if (ret) {
+				flash_error(ret);
+			}
+		}
+		else if (stream_input)
+		{
+			int ret = flash_prog_stream(f, stream_prefix, stream_prefix_len, disable_protect, dont_erase, bulk_erase, erase_block_size, !disable_verify, rw_offset);
+			if (compressed) {
+				int rc = decompress_finish(compressed, -1);
+				if (!ret)
+					ret = rc;
+				compressed = NULL;
+				f = NULL;
+			}
+			if (ret) {
+				flash_error(ret);
+			}
+		}
+		else if (!read_mode && !check_mode && compressed)
+		{
+			int ret = prog_flash(f, file_size, false, disable_protect, dont_erase, bulk_erase, erase_mode, erase_block_size, rw_offset);
+			if (!ret)
+				ret = decompress_finish(compressed, file_size);
+			else
+				decompress_close(compressed);
+			compressed = NULL;
+			f = NULL;
+
+			/* Decompress once more for the verify pass */
+			if (!ret && !disable_verify) {
+				rewind(compressed_input);
+				compressed = decompress_open(compressed_input, NULL, 0);
+				if (!compressed)
+					ret = EXIT_FAILURE;
+				else
+					f = decompress_stream(compressed);
+			}
+			if (ret) {
+				flash_error(ret);
+			}
+		}
+		else if (erase_mode)
+		{
+			/* -e has no file to size, just the length to erase */
+			int ret = prog_flash(NULL, file_size, false, disable_protect, dont_erase, bulk_erase, erase_mode, erase_block_size, rw_offset);
+			if (ret) {
+				flash_error(ret);
+			}
+		}
+		else if (!read_mode && !check_mode)
 		{
-			int ret = ecp_prog_flash(f, disable_protect, dont_erase, bulk_erase, erase_mode, erase_block_size, rw_offset, NULL);
+			int ret = ecp_prog_flash(f, disable_protect, dont_erase, bulk_erase, erase_mode, erase_block_size, rw_offset);
 			if (ret) {
-				return ret;
+				flash_error(ret);
 			}
 		}
 
@@ -1392,40 +3968,81 @@ int main(int argc, char **argv)
 		// Read/Verify
 		// ---------------------------------------------------------
 
-		if (read_mode) {
-
-			flash_start_read(rw_offset);
-			for (int addr = 0; addr < read_size; addr += 4096) {
-				uint8_t buffer[4096];
-
-				/* Show progress */
-				fprintf(stderr, "\r\033[0Kreading..    %04u/%04u", addr + 4096, read_size);
-
-				flash_continue_read(buffer, 4096);
-				fwrite(buffer, read_size - addr > 4096 ? 4096 : read_size - addr, 1, f);
+		if (read_mode && dry_run) {
+			if (flash_read_stream(rw_offset, read_size, PROGRESS_READ, "reading..", discard_chunk, NULL))
+				flash_error(EXIT_FAILURE);
+			fprintf(stderr, "\n");
+		} else if (hash_mode) {
+			if (flash_hash(f, rw_offset, read_size, hash_stop_at_end))
+				flash_error(EXIT_FAILURE);
+		} else if (read_mode) {
+			struct sparse_writer *w = sparse_open(f, sparse_output, trim_output);
+			if (!w) {
+				perror("can't write output file");
+				flash_error(EXIT_FAILURE);
 			}
+			int rc = flash_read_stream(rw_offset, read_size, PROGRESS_READ, "reading..", write_chunk, w);
 			fprintf(stderr, "\n");
-		} else if (!erase_mode && !disable_verify) {
+			int64_t image_size = sparse_close(w);
+			if (rc || image_size < 0)
+				flash_error(EXIT_FAILURE);
+			if ((uint64_t)image_size != read_size)
+				fprintf(stderr, "image ends at 0x%" PRIx64 "\n", (uint64_t)image_size);
+		} else if (image_mode && !disable_verify) {
+			if (ecp_image_verify(&image)) {
+				flash_error(3);
+			}
+		} else if (compressed && !disable_verify) {
+			int ret = flash_verify_file(f, file_size, rw_offset);
+			if (!ret)
+				ret = decompress_finish(compressed, file_size);
+			else
+				decompress_close(compressed);
+			compressed = NULL;
+			f = NULL;
+			if (ret) {
+				flash_error(3);
+			}
+		} else if (!erase_mode && !stream_input && !disable_verify) {
 			
 			if (ecp_flash_verify(f, rw_offset)) {
-				jtag_error(3);
+				flash_error(3);
 			}
 		}
+
+		if (slot_target >= 0) {
+			int ret = slot_activate(slot_target, f, file_size);
+			if (ret)
+				flash_error(ret);
+		}
+
+		ecp_exit_flash_mode();
 	}
 
 	if (reinitialize) {
 		fprintf(stderr, "rebooting ECP5...\n");
+		double start = report_time();
 		ecp_jtag_cmd(LSC_REFRESH);
+		report_add(REPORT_REFRESH, start, 0);
 	}
 
-	if (f != NULL && f != stdin && f != stdout)
+	if (compressed)
+		decompress_close(compressed);
+	else if (f != NULL && f != stdin && f != stdout)
 		fclose(f);
+	if (compressed_input != NULL)
+		fclose(compressed_input);
+	image_free(&image);
 
 	// ---------------------------------------------------------
 	// Exit
 	// ---------------------------------------------------------
 
+	if (dry_run)
+		dryrun_print();
+
 	fprintf(stderr, "Bye.\n");
 	jtag_deinit();
+	report_info.ok = true;
 	return 0;
 }
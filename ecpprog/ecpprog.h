@@ -2,14 +2,22 @@
 #define __ECPPROG_H__
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-typedef void (*callback_t)(void);
+#include "progress.h"
+
 uint32_t read_idcode();
+uint32_t read_usercode();
 uint64_t read_unique_id();
-void ecp_prog_sram(FILE *f, bool verbose);
-int ecp_prog_flash(FILE *f, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, int rw_offset, callback_t cb);
-int  ecp_flash_verify(FILE *f, int rw_offset);
+int  ecp_prog_sram(FILE *f, bool verbose);
+int ecp_prog_flash(FILE *f, bool disable_protect, bool dont_erase, bool bulk_erase, bool erase_mode, int erase_block_size, uint64_t rw_offset);
+int  ecp_flash_verify(FILE *f, uint64_t rw_offset);
 void ecp_init_flash_mode();
 
+struct image;
+int ecp_prog_image(const struct image *img, bool disable_protect, bool dont_erase, bool bulk_erase, int erase_block_size);
+int ecp_image_verify(const struct image *img);
+void ecp_exit_flash_mode();
+
 #endif
\ No newline at end of file
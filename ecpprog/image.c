@@ -0,0 +1,398 @@
+/*
+ * Multi-segment flash images, see image.h
+ *
+ *  Relevant Documents:
+ *  -------------------
+ *  Intel Hexadecimal Object File Format Specification, Rev. A
+ *  System V Application Binary Interface, chapter 5 (ELF program headers)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "image.h"
+#include "sparse.h"
+
+#define ELF_PT_LOAD 1
+
+static int image_add(struct image *img, uint64_t addr, FILE *f, long size, const char *source)
+{
+	struct image_segment *s = realloc(img->segments, (img->count + 1) * sizeof(*s));
+	if (!s) {
+		fclose(f);
+		return -1;
+	}
+	img->segments = s;
+
+	s += img->count++;
+	s->addr = addr;
+	s->size = size;
+	s->f = f;
+	snprintf(s->source, sizeof(s->source), "%s", source);
+	return 0;
+}
+
+void image_free(struct image *img)
+{
+	for (unsigned i = 0; i < img->count; i++)
+		fclose(img->segments[i].f);
+	free(img->segments);
+	img->segments = NULL;
+	img->count = 0;
+}
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), m = strlen(suffix);
+	if (n < m)
+		return false;
+	for (size_t i = 0; i < m; i++)
+		if (tolower((unsigned char)name[n - m + i]) != suffix[i])
+			return false;
+	return true;
+}
+
+static bool is_hex_name(const char *filename)
+{
+	return has_suffix(filename, ".hex") || has_suffix(filename, ".ihex") || has_suffix(filename, ".mcs");
+}
+
+static bool is_elf(FILE *f)
+{
+	uint8_t magic[4];
+	bool found = fread(magic, 1, 4, f) == 4 && memcmp(magic, "\x7f" "ELF", 4) == 0;
+
+	rewind(f);
+	return found;
+}
+
+bool image_is_segmented(const char *filename)
+{
+	if (is_hex_name(filename))
+		return true;
+
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	bool elf = is_elf(f);
+	fclose(f);
+	return elf;
+}
+
+/* Intel HEX: data records are merged into segments while they are contiguous */
+static int load_hex(struct image *img, FILE *in, const char *name, int64_t offset)
+{
+	char line[600];
+	uint8_t rec[256 + 5];
+	uint64_t base = 0;
+	FILE *seg = NULL;
+	uint64_t seg_addr = 0;
+	long seg_size = 0;
+	int lineno = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+
+		char *p = line;
+		while (isspace((unsigned char)*p))
+			p++;
+		if (!*p)
+			continue;
+		if (*p++ != ':')
+			goto bad;
+
+		/* Decode the record and check its checksum */
+		int n = 0;
+		uint8_t sum = 0;
+		while (isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1]) && n < (int)sizeof(rec)) {
+			unsigned v;
+			sscanf(p, "%2x", &v);
+			rec[n++] = v;
+			sum += v;
+			p += 2;
+		}
+		if (n < 5 || n != rec[0] + 5 || sum != 0)
+			goto bad;
+
+		uint8_t len = rec[0];
+		uint32_t addr = (rec[1] << 8) | rec[2];
+		uint8_t *data = rec + 4;
+
+		switch (rec[3]) {
+		case 0x00: /* data */
+			if (!seg || base + addr != seg_addr + seg_size) {
+				if (seg && image_add(img, seg_addr + offset, seg, seg_size, name))
+					return -1;
+				if (!(seg = tmpfile()))
+					return -1;
+				seg_addr = base + addr;
+				seg_size = 0;
+			}
+			if (fwrite(data, 1, len, seg) != len)
+				goto error;
+			seg_size += len;
+			break;
+		case 0x01: /* end of file */
+			goto done;
+		case 0x02: /* extended segment address */
+			if (len != 2)
+				goto bad;
+			base = (uint64_t)((data[0] << 8) | data[1]) << 4;
+			break;
+		case 0x04: /* extended linear address */
+			if (len != 2)
+				goto bad;
+			base = (uint64_t)((data[0] << 8) | data[1]) << 16;
+			break;
+		case 0x03: /* start segment address */
+		case 0x05: /* start linear address */
+			break;
+		default:
+			goto bad;
+		}
+	}
+
+done:
+	if (seg)
+		return image_add(img, seg_addr + offset, seg, seg_size, name);
+	return 0;
+
+bad:
+	fprintf(stderr, "%s:%d: invalid Intel HEX record\n", name, lineno);
+error:
+	if (seg)
+		fclose(seg);
+	return -1;
+}
+
+static uint64_t get_uint(const uint8_t *p, int n, bool big_endian)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < n; i++)
+		v = (v << 8) | p[big_endian ? i : n - 1 - i];
+	return v;
+}
+
+static FILE *copy_range(FILE *in, long offset, long size)
+{
+	uint8_t buffer[4096];
+	FILE *out = tmpfile();
+
+	if (!out || fseek(in, offset, SEEK_SET) == -1)
+		goto error;
+
+	for (long done = 0; done < size; ) {
+		size_t n = (size - done > (long)sizeof(buffer)) ? sizeof(buffer) : (size_t)(size - done);
+		if (fread(buffer, 1, n, in) != n || fwrite(buffer, 1, n, out) != n)
+			goto error;
+		done += n;
+	}
+	if (fflush(out) == 0)
+		return out;
+
+error:
+	if (out)
+		fclose(out);
+	return NULL;
+}
+
+/* ELF: every PT_LOAD program header with file contents becomes a segment */
+static int load_elf(struct image *img, FILE *in, const char *name, int64_t offset)
+{
+	uint8_t ehdr[64], phdr[56];
+
+	if (fread(ehdr, 1, sizeof(ehdr), in) < 52)
+		goto bad;
+
+	bool is64 = ehdr[4] == 2;
+	bool be = ehdr[5] == 2;
+	uint64_t phoff = is64 ? get_uint(ehdr + 32, 8, be) : get_uint(ehdr + 28, 4, be);
+	unsigned phentsize = get_uint(ehdr + (is64 ? 54 : 42), 2, be);
+	unsigned phnum = get_uint(ehdr + (is64 ? 56 : 44), 2, be);
+
+	if ((ehdr[4] != 1 && ehdr[4] != 2) || phentsize < (is64 ? 56u : 32u))
+		goto bad;
+
+	for (unsigned i = 0; i < phnum; i++) {
+		if (fseek(in, phoff + (uint64_t)i * phentsize, SEEK_SET) == -1 ||
+		    fread(phdr, 1, is64 ? 56 : 32, in) != (is64 ? 56u : 32u))
+			goto bad;
+
+		uint32_t type = get_uint(phdr, 4, be);
+		uint64_t p_offset = is64 ? get_uint(phdr + 8, 8, be) : get_uint(phdr + 4, 4, be);
+		uint64_t paddr = is64 ? get_uint(phdr + 24, 8, be) : get_uint(phdr + 12, 4, be);
+		uint64_t filesz = is64 ? get_uint(phdr + 32, 8, be) : get_uint(phdr + 16, 4, be);
+
+		if (type != ELF_PT_LOAD || filesz == 0)
+			continue;
+
+		FILE *seg = copy_range(in, p_offset, filesz);
+		if (!seg)
+			goto bad;
+		if (image_add(img, paddr + offset, seg, filesz, name))
+			return -1;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "%s: invalid or truncated ELF file\n", name);
+	return -1;
+}
+
+/* Binary or sparse image, one segment at 'offset' */
+static int load_binary(struct image *img, FILE *in, const char *name, int64_t offset)
+{
+	long size;
+	FILE *seg;
+
+	if (sparse_detect(in))
+		seg = sparse_expand(in, &size);
+	else if (fseek(in, 0, SEEK_END) == -1 || (size = ftell(in)) < 0)
+		seg = NULL;
+	else
+		seg = copy_range(in, 0, size);
+
+	if (!seg) {
+		fprintf(stderr, "%s: can't read image\n", name);
+		return -1;
+	}
+	return image_add(img, offset, seg, size, name);
+}
+
+static int load_file(struct image *img, const char *filename, int64_t offset)
+{
+	FILE *in = fopen(filename, "rb");
+	if (!in) {
+		fprintf(stderr, "can't open '%s' for reading: ", filename);
+		perror(0);
+		return -1;
+	}
+
+	const char *name = strrchr(filename, '/');
+	name = name ? name + 1 : filename;
+
+	int rc;
+	if (is_hex_name(filename))
+		rc = load_hex(img, in, name, offset);
+	else if (is_elf(in))
+		rc = load_elf(img, in, name, offset);
+	else
+		rc = load_binary(img, in, name, offset);
+
+	fclose(in);
+	return rc;
+}
+
+static int load_manifest(struct image *img, const char *filename, int64_t offset)
+{
+	char line[1024], path[1280];
+	int lineno = 0;
+
+	FILE *in = fopen(filename, "r");
+	if (!in) {
+		fprintf(stderr, "can't open '%s' for reading: ", filename);
+		perror(0);
+		return -1;
+	}
+
+	/* Directory of the manifest, for relative file names */
+	const char *slash = strrchr(filename, '/');
+	int dirlen = slash ? (int)(slash - filename + 1) : 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+
+		char *hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char *p = line;
+		while (isspace((unsigned char)*p))
+			p++;
+		if (!*p)
+			continue;
+
+		char *end;
+		int64_t entry = strtoll(p, &end, 0);
+		if (*end == 'k')
+			entry *= 1024, end++;
+		else if (*end == 'M')
+			entry *= 1024 * 1024, end++;
+		if (end == p || !isspace((unsigned char)*end)) {
+			fprintf(stderr, "%s:%d: expected \"<offset> <file>\"\n", filename, lineno);
+			fclose(in);
+			return -1;
+		}
+
+		p = end;
+		while (isspace((unsigned char)*p))
+			p++;
+		end = p + strlen(p);
+		while (end > p && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+
+		if (*p == '/')
+			snprintf(path, sizeof(path), "%s", p);
+		else
+			snprintf(path, sizeof(path), "%.*s%s", dirlen, filename, p);
+
+		if (load_file(img, path, offset + entry)) {
+			fclose(in);
+			return -1;
+		}
+	}
+
+	fclose(in);
+	return 0;
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+	const struct image_segment *x = a, *y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+int image_load(struct image *img, const char *filename, int64_t offset, bool manifest)
+{
+	img->segments = NULL;
+	img->count = 0;
+
+	int rc = manifest ? load_manifest(img, filename, offset) : load_file(img, filename, offset);
+	if (rc)
+		goto error;
+
+	if (!img->count) {
+		fprintf(stderr, "%s: no data to program\n", filename);
+		goto error;
+	}
+
+	for (unsigned i = 0; i < img->count; i++) {
+		/* Negative results wrap around to huge addresses */
+		if (img->segments[i].addr >= (1ULL << 40)) {
+			fprintf(stderr, "%s: segment below flash address 0\n", img->segments[i].source);
+			goto error;
+		}
+		rewind(img->segments[i].f);
+	}
+
+	qsort(img->segments, img->count, sizeof(*img->segments), compare_segments);
+
+	for (unsigned i = 1; i < img->count; i++) {
+		struct image_segment *prev = &img->segments[i - 1], *s = &img->segments[i];
+		if (s->addr < prev->addr + prev->size) {
+			fprintf(stderr, "%s at 0x%06" PRIx64 " overlaps %s at 0x%06" PRIx64 "\n",
+				s->source, s->addr, prev->source, prev->addr);
+			goto error;
+		}
+	}
+	return 0;
+
+error:
+	image_free(img);
+	return -1;
+}
@@ -0,0 +1,45 @@
+/*
+ * Flash images made of several segments.
+ *
+ * An image is loaded from one of:
+ *  - a plain binary or sparse image (see sparse.h), one segment at 0
+ *  - an Intel HEX file (.hex, .ihex, .mcs), addresses taken from the records
+ *  - an ELF file, one segment per PT_LOAD program header at its physical address
+ *  - a manifest, a text file with one "<offset> <file>" line per entry. Each
+ *    file is loaded as above and its segments are moved up by the offset
+ *    (which may be negative, to map CPU addresses back to flash offsets).
+ *    Offsets take the same 'k' and 'M' suffixes as -o, '#' starts a comment
+ *    and relative file names are relative to the manifest.
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct image_segment {
+	uint64_t addr;       /* flash address */
+	long size;
+	FILE *f;             /* segment data, from file offset 0 */
+	char source[64];     /* for messages */
+};
+
+struct image {
+	struct image_segment *segments; /* sorted by address, not overlapping */
+	unsigned count;
+};
+
+/**
+ * Loads 'filename', a manifest if 'manifest' is set, moving all segments
+ * up by 'offset'. Returns 0 on success, errors are reported on stderr.
+ */
+int image_load(struct image *img, const char *filename, int64_t offset, bool manifest);
+
+void image_free(struct image *img);
+
+/* True if 'filename' should be loaded by image_load() rather than as a plain binary */
+bool image_is_segmented(const char *filename);
+
+#endif
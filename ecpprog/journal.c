@@ -0,0 +1,169 @@
+/*
+ * Flash programming journal, see journal.h
+ *
+ * The file starts with a line identifying the run, followed by a line per
+ * completed step:
+ *
+ *   image <sha256> <offset> <size> <block size>
+ *   erase <addr>
+ *   program <addr>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "journal.h"
+#include "cache.h"
+
+struct journal {
+	char name[64];
+	FILE *f;
+	char header[160];
+	uint64_t begin;      /* first erase block */
+	uint32_t block_size;
+	uint32_t blocks;
+	bool *erased;
+	uint64_t programmed;
+	bool interrupted;
+};
+
+static void load(struct journal *j, bool resume)
+{
+	char line[160];
+	FILE *f = cache_fopen(j->name, "r");
+	if (!f)
+		return;
+
+	if (fgets(line, sizeof(line), f) && !strcmp(line, j->header)) {
+		j->interrupted = true;
+
+		while (resume && fgets(line, sizeof(line), f)) {
+			uint64_t addr;
+			if (sscanf(line, "erase %" SCNx64, &addr) == 1 && addr >= j->begin &&
+			    (addr - j->begin) / j->block_size < j->blocks)
+				j->erased[(addr - j->begin) / j->block_size] = true;
+			else if (sscanf(line, "program %" SCNx64, &addr) == 1)
+				j->programmed = addr;
+		}
+	}
+	fclose(f);
+
+	/* Programming may have stopped anywhere in the block after the mark */
+	if (j->programmed > j->begin && (j->programmed - j->begin) / j->block_size < j->blocks)
+		j->erased[(j->programmed - j->begin) / j->block_size] = false;
+}
+
+/* Rewrites the file with the progress kept */
+static int save(struct journal *j)
+{
+	if (j->f)
+		fclose(j->f);
+	j->f = cache_fopen(j->name, "w");
+	if (!j->f)
+		return -1;
+
+	fputs(j->header, j->f);
+	for (uint32_t i = 0; i < j->blocks; i++)
+		if (j->erased[i])
+			fprintf(j->f, "erase %" PRIx64 "\n", j->begin + (uint64_t)i * j->block_size);
+	if (j->programmed)
+		fprintf(j->f, "program %" PRIx64 "\n", j->programmed);
+	return fflush(j->f) ? -1 : 0;
+}
+
+struct journal *journal_open(uint64_t unique_id, const uint8_t image_hash[SHA256_SIZE],
+                             uint64_t offset, uint64_t size, uint32_t block_size, bool resume)
+{
+	struct journal *j = calloc(1, sizeof(*j));
+	if (!j)
+		return NULL;
+
+	uint64_t mask = block_size - 1;
+	j->begin = offset & ~mask;
+	j->block_size = block_size;
+	j->blocks = (((offset + size + mask) & ~mask) - j->begin) / block_size;
+	j->erased = calloc(j->blocks ? j->blocks : 1, sizeof(*j->erased));
+	if (!j->erased) {
+		free(j);
+		return NULL;
+	}
+
+	snprintf(j->name, sizeof(j->name), "journal-%016" PRIx64 ".txt", unique_id);
+	int n = snprintf(j->header, sizeof(j->header), "image ");
+	for (int i = 0; i < SHA256_SIZE; i++)
+		n += snprintf(j->header + n, sizeof(j->header) - n, "%02x", image_hash[i]);
+	snprintf(j->header + n, sizeof(j->header) - n, " %" PRIx64 " %" PRIx64 " %x\n", offset, size, block_size);
+
+	load(j, resume);
+	if (save(j)) {
+		journal_close(j);
+		return NULL;
+	}
+	return j;
+}
+
+bool journal_interrupted(const struct journal *j)
+{
+	return j->interrupted;
+}
+
+bool journal_erased(const struct journal *j, uint64_t addr)
+{
+	uint64_t block = (addr - j->begin) / j->block_size;
+	return addr >= j->begin && block < j->blocks && j->erased[block];
+}
+
+uint64_t journal_programmed(const struct journal *j)
+{
+	return j->programmed;
+}
+
+uint32_t journal_block_size(const struct journal *j)
+{
+	return j->block_size;
+}
+
+void journal_erase_done(struct journal *j, uint64_t addr)
+{
+	fprintf(j->f, "erase %" PRIx64 "\n", addr);
+	fflush(j->f);
+
+	if (addr >= j->begin && (addr - j->begin) / j->block_size < j->blocks)
+		j->erased[(addr - j->begin) / j->block_size] = true;
+}
+
+void journal_program_done(struct journal *j, uint64_t addr)
+{
+	fprintf(j->f, "program %" PRIx64 "\n", addr);
+	fflush(j->f);
+	j->programmed = addr;
+}
+
+void journal_reset(struct journal *j)
+{
+	memset(j->erased, 0, j->blocks * sizeof(*j->erased));
+	j->programmed = 0;
+	save(j);
+}
+
+void journal_finish(struct journal *j)
+{
+	fclose(j->f);
+	j->f = NULL;
+	cache_remove(j->name);
+	journal_close(j);
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+	if (j->f)
+		fclose(j->f);
+	free(j->erased);
+	free(j);
+}
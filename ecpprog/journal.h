@@ -0,0 +1,53 @@
+/*
+ * Progress journal of a flash programming run, so an interrupted run can be
+ * resumed without erasing and programming everything again.
+ *
+ * The journal is kept per board (ECP5 unique ID) and only applies to the
+ * same image, offset and erase block size. It records each erased block
+ * and, at every block boundary, how far programming has come. It is deleted
+ * once programming completes.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+struct journal;
+
+/**
+ * Starts the journal for writing 'size' bytes at 'offset', in erase blocks
+ * of 'block_size'. With 'resume', the progress an earlier run of the same
+ * image recorded is kept. Returns NULL if the journal can't be written.
+ */
+struct journal *journal_open(uint64_t unique_id, const uint8_t image_hash[SHA256_SIZE],
+                             uint64_t offset, uint64_t size, uint32_t block_size, bool resume);
+
+/* True if an earlier run of the same image was interrupted */
+bool journal_interrupted(const struct journal *j);
+
+/* True if the block at 'addr' is recorded as erased */
+bool journal_erased(const struct journal *j, uint64_t addr);
+
+/* Address up to which the image is recorded as programmed */
+uint64_t journal_programmed(const struct journal *j);
+
+/* Programming progress is recorded at multiples of this */
+uint32_t journal_block_size(const struct journal *j);
+
+void journal_erase_done(struct journal *j, uint64_t addr);
+void journal_program_done(struct journal *j, uint64_t addr);
+
+/* Forgets the recorded progress */
+void journal_reset(struct journal *j);
+
+/* Deletes the journal, the run has completed */
+void journal_finish(struct journal *j);
+
+/* Closes the journal, keeping it for a later --resume */
+void journal_close(struct journal *j);
+
+#endif
@@ -58,8 +58,32 @@ void jtag_tap_shift(
 	uint32_t data_bits,
 	bool must_end);
 
+/**
+ * Like jtag_tap_shift(), but TDO is not read back. Whole bytes are queued
+ * without waiting for the adapter, so the TAP must not be used from another
+ * thread until the next call that reads data.
+ */
+void jtag_tap_write(
+	const uint8_t *input_data,
+	uint32_t data_bits,
+	bool must_end);
+
 void jtag_error(int status);
 
+/**
+ * What the TAP layer did since jtag_init(), for --stats.
+ */
+struct jtag_stats {
+	uint64_t tms_transitions; /* TAP state changes */
+	uint64_t tms_commands;    /* MPSSE commands only moving the TAP */
+	uint64_t ir_scans;
+	uint64_t dr_scans;
+	uint64_t bit_commands;    /* one per bit shifted in bit mode */
+	uint64_t byte_commands;
+};
+
+extern struct jtag_stats jtag_stats;
+
 void jtag_wait_time(uint32_t microseconds);
 
 void jtag_go_to_state(unsigned state);
@@ -15,6 +15,7 @@
 
 #include "mpsse.h"
 #include "jtag.h"
+#include "trace.h"
 
 void jtag_state_ack(bool tms);
 
@@ -109,6 +110,8 @@ static const uint16_t tms_map[] = {
 
 static uint8_t current_state;
 
+struct jtag_stats jtag_stats;
+
 uint8_t jtag_current_state(void)
 {
 	return current_state;
@@ -178,6 +181,7 @@ static void _jtag_tap_shift(
 		}
 	}
 
+	jtag_stats.bit_commands += rx_cnt;
 	mpsse_xfer(data, ptr-data, rx_cnt);
 	
 	/* Data out from the FTDI is actually from an internal shift register
@@ -187,6 +191,11 @@ static void _jtag_tap_shift(
 }
 
 
+/* One MPSSE byte command moves at most 64 kB */
+#define JTAG_MAX_SHIFT_BYTES 65536
+
+static uint8_t shift_tx[JTAG_MAX_SHIFT_BYTES + 3];
+
 static void jtag_shift_bytes(
 	uint8_t *input_data,
 	uint8_t *output_data,
@@ -200,14 +209,14 @@ static void jtag_shift_bytes(
 	}
 	//printf("jtag_shift_bytes(0x%08x,0x%08x,%u,%s);\n",input_data, output_data, data_bits, must_end ? "true" : "false");
 	uint32_t byte_count = data_bits / 8;
-	data[0] = MC_DATA_OUT | MC_DATA_IN | MC_DATA_LSB | MC_DATA_OCN | MC_DATA_ICN;
-	data[1] = (byte_count - 1); 
-	data[2] = (byte_count - 1) >> 8;        
-	memcpy(data + 3, input_data, byte_count);
-
-	mpsse_xfer(data, byte_count + 3, byte_count);
-
-	memcpy(output_data, data, byte_count);
+	shift_tx[0] = MC_DATA_OUT | MC_DATA_IN | MC_DATA_LSB | MC_DATA_OCN | MC_DATA_ICN;
+	shift_tx[1] = (byte_count - 1); 
+	shift_tx[2] = (byte_count - 1) >> 8;        
+	memcpy(shift_tx + 3, input_data, byte_count);
+
+	/* The input has been copied, so TDO can land straight in the output buffer */
+	jtag_stats.byte_commands++;
+	mpsse_xfer_stream(shift_tx, byte_count + 3, output_data, byte_count);
 }
 
 #ifndef MIN
@@ -222,9 +231,11 @@ void jtag_tap_shift(
 {
 	/* if 'must_end' the send last byte seperately 
 	 * This way we toggle TMS on the last clock cycle */
+	trace_begin("jtag_tap_shift");
+	uint32_t bytes = (data_bits + 7) / 8;
 
 	while (data_bits >= (8 + must_end)) {
-		uint32_t _data_bits = MIN(4096 + 2048, data_bits - must_end) & ~7U;
+		uint32_t _data_bits = MIN(JTAG_MAX_SHIFT_BYTES * 8, data_bits - must_end) & ~7U;
 
 		jtag_shift_bytes(
 			input_data,
@@ -246,14 +257,64 @@ void jtag_tap_shift(
 			must_end
 		);
 	}
+	trace_end_bytes(bytes);
+}
+
+/* Queued write-only shifts each need their own buffer until the USB
+ * transfer completes, see MPSSE_WRITES_IN_FLIGHT */
+#define JTAG_WRITE_SLOTS (MPSSE_WRITES_IN_FLIGHT + 1)
+
+static uint8_t write_tx[JTAG_WRITE_SLOTS][JTAG_MAX_SHIFT_BYTES + 3];
+static unsigned write_slot;
+
+void jtag_tap_write(
+	const uint8_t *input_data,
+	uint32_t data_bits,
+	bool must_end)
+{
+	trace_begin("jtag_tap_write");
+	uint32_t bytes = (data_bits + 7) / 8;
+
+	while (data_bits >= (8 + must_end)) {
+		uint32_t byte_count = (MIN(JTAG_MAX_SHIFT_BYTES * 8, data_bits - must_end)) / 8;
+		uint8_t *tx = write_tx[write_slot];
+		write_slot = (write_slot + 1) % JTAG_WRITE_SLOTS;
+
+		tx[0] = MC_DATA_OUT | MC_DATA_LSB | MC_DATA_OCN;
+		tx[1] = (byte_count - 1);
+		tx[2] = (byte_count - 1) >> 8;
+		memcpy(tx + 3, input_data, byte_count);
+		jtag_stats.byte_commands++;
+		mpsse_write_stream(tx, byte_count + 3);
+
+		data_bits  -= byte_count * 8;
+		input_data += byte_count;
+	}
+
+	if (data_bits > 0) {
+		uint8_t tail[2];
+		memcpy(tail, input_data, (data_bits + 7) / 8);
+		_jtag_tap_shift(tail, tail, data_bits, must_end);
+	}
+	trace_end_bytes(bytes);
 }
 
 void jtag_state_ack(bool tms)
 {
+	uint8_t state = jtag_current_state();
+
 	if (tms) {
-		jtag_set_current_state((tms_transitions[jtag_current_state()] >> 4) & 0xf);
+		jtag_set_current_state((tms_transitions[state] >> 4) & 0xf);
 	} else {
-		jtag_set_current_state(tms_transitions[jtag_current_state()] & 0xf);
+		jtag_set_current_state(tms_transitions[state] & 0xf);
+	}
+
+	if (jtag_current_state() != state) {
+		jtag_stats.tms_transitions++;
+		if (jtag_current_state() == STATE_SHIFT_IR)
+			jtag_stats.ir_scans++;
+		if (jtag_current_state() == STATE_SHIFT_DR)
+			jtag_stats.dr_scans++;
 	}
 }
 
@@ -270,6 +331,7 @@ void jtag_go_to_state(unsigned state)
 			5 - 1,
 			0b11111
 		};
+		jtag_stats.tms_commands++;
 		mpsse_xfer(data, 3, 0);
 		
 	} else {
@@ -281,6 +343,7 @@ void jtag_go_to_state(unsigned state)
 			};
 
 			jtag_state_ack((tms_map[jtag_current_state()] >> state) & 1);
+			jtag_stats.tms_commands++;
 			mpsse_xfer(data, 3, 0);
 		}
 	}
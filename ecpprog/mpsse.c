@@ -29,8 +29,10 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "mpsse.h"
+#include "trace.h"
 
 // ---------------------------------------------------------
 // MPSSE / FTDI definitions
@@ -54,11 +56,20 @@ bool mpsse_ftdic_open = false;
 bool mpsse_ftdic_latency_set = false;
 unsigned char mpsse_ftdi_latency;
 
+struct mpsse_stats mpsse_stats;
+
 
 // ---------------------------------------------------------
 // MPSSE / FTDI function implementations
 // ---------------------------------------------------------
 
+static double mpsse_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 void mpsse_check_rx()
 {
 	uint8_t cnt = 0;
@@ -75,24 +86,25 @@ void mpsse_check_rx()
 	}
 }
 
-void mpsse_error(int status)
+static void adapter_abort(void)
 {
 	//mpsse_check_rx();
-	fprintf(stderr, "ABORT.\n");
 	if (mpsse_ftdic_open) {
 		if (mpsse_ftdic_latency_set)
 			ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
 		ftdi_usb_close(&mpsse_ftdic);
 	}
 	ftdi_deinit(&mpsse_ftdic);
-	exit(status);
 }
 
-uint8_t mpsse_recv_byte()
+static uint8_t adapter_recv_byte(void)
 {
 	uint8_t data;
+	double start = mpsse_time();
+	trace_begin("usb read");
 	while (1) {
 		int rc = ftdi_read_data(&mpsse_ftdic, &data, 1);
+		mpsse_stats.usb_reads++;
 		if (rc < 0) {
 			fprintf(stderr, "Read error.\n");
 			mpsse_error(2);
@@ -101,12 +113,21 @@ uint8_t mpsse_recv_byte()
 			break;
 		usleep(100);
 	}
+	mpsse_stats.bytes_in++;
+	mpsse_stats.round_trips++;
+	mpsse_stats.blocked += mpsse_time() - start;
+	trace_end_xfer(0, 1);
 	return data;
 }
 
-void mpsse_send_byte(uint8_t data)
+static void adapter_send_byte(uint8_t data)
 {
+	mpsse_write_flush();
+	trace_begin("usb write");
 	int rc = ftdi_write_data(&mpsse_ftdic, &data, 1);
+	trace_end_xfer(1, 0);
+	mpsse_stats.usb_writes++;
+	mpsse_stats.bytes_out++;
 	if (rc != 1) {
 		fprintf(stderr, "Write error (single byte, rc=%d, expected %d)(%s).\n", rc, 1, ftdi_get_error_string(&mpsse_ftdic));
 		mpsse_error(2);
@@ -114,10 +135,18 @@ void mpsse_send_byte(uint8_t data)
 }
 
 
-void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length)
+static void adapter_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length)
 {
+	mpsse_write_flush();
+	double start = mpsse_time();
+	trace_begin("mpsse_xfer");
+
 	if(send_length){
+		trace_begin("usb write");
 		int rc = ftdi_write_data(&mpsse_ftdic, data_buffer, send_length);
+		trace_end_xfer(send_length, 0);
+		mpsse_stats.usb_writes++;
+		mpsse_stats.bytes_out += send_length;
 		if (rc != send_length) {
 			fprintf(stderr, "Write error (rc=%d, expected %d)[%s]\n", rc, 1, ftdi_get_error_string(&mpsse_ftdic));
 			mpsse_error(2);
@@ -128,8 +157,10 @@ void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_len
 		/* Calls to ftdi_read_data may return with less data than requested if it wasn't ready. 
 		 * We stay in this while loop to collect all the data that we expect. */
 		uint16_t rx_len = 0;
+		trace_begin("usb read");
 		while(rx_len != receive_length){
 			int rc = ftdi_read_data(&mpsse_ftdic, data_buffer + rx_len, receive_length - rx_len);
+			mpsse_stats.usb_reads++;
 			if (rc < 0) {
 				fprintf(stderr, "Read error (rc=%d)[%s]\n", rc, ftdi_get_error_string(&mpsse_ftdic));
 				mpsse_error(2);
@@ -137,10 +168,161 @@ void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_len
 				rx_len += rc;
 			}
 		}
+		trace_end_xfer(0, receive_length);
+		mpsse_stats.bytes_in += receive_length;
+		mpsse_stats.round_trips++;
 	}
+	mpsse_stats.blocked += mpsse_time() - start;
+	trace_end_xfer(send_length, receive_length);
 }
 
-void mpsse_init(int ifnum, const char *devstr, int clkdiv)
+/* Large transfers where the whole reply is expected back. With libftdi1 the read
+ * is posted before the write, so the FTDI never stalls on a full RX FIFO and the
+ * USB traffic in both directions overlaps. Older libftdi versions fall back to
+ * writing small slices and draining the RX side in between. */
+static void adapter_xfer_stream(uint8_t *tx_buffer, uint32_t send_length, uint8_t *rx_buffer, uint32_t receive_length)
+{
+	mpsse_write_flush();
+	double start = mpsse_time();
+	trace_begin("mpsse_xfer_stream");
+
+#if defined(FTDI_MAJOR_VERSION) && (FTDI_MAJOR_VERSION >= 1)
+	struct ftdi_transfer_control *rd = NULL;
+	struct ftdi_transfer_control *wr;
+
+	if (receive_length) {
+		rd = ftdi_read_data_submit(&mpsse_ftdic, rx_buffer, receive_length);
+		mpsse_stats.usb_reads++;
+		if (rd == NULL) {
+			fprintf(stderr, "Read submit error [%s]\n", ftdi_get_error_string(&mpsse_ftdic));
+			mpsse_error(2);
+		}
+	}
+
+	wr = ftdi_write_data_submit(&mpsse_ftdic, tx_buffer, send_length);
+	mpsse_stats.usb_writes++;
+	if (wr == NULL) {
+		fprintf(stderr, "Write submit error [%s]\n", ftdi_get_error_string(&mpsse_ftdic));
+		mpsse_error(2);
+	}
+
+	int rc = ftdi_transfer_data_done(wr);
+	if (rc != send_length) {
+		fprintf(stderr, "Write error (rc=%d, expected %u)[%s]\n", rc, send_length, ftdi_get_error_string(&mpsse_ftdic));
+		mpsse_error(2);
+	}
+
+	if (rd) {
+		rc = ftdi_transfer_data_done(rd);
+		if (rc != receive_length) {
+			fprintf(stderr, "Read error (rc=%d, expected %u)[%s]\n", rc, receive_length, ftdi_get_error_string(&mpsse_ftdic));
+			mpsse_error(2);
+		}
+	}
+#else
+	uint32_t rx_len = 0;
+
+	for (uint32_t tx_len = 0; tx_len < send_length; ) {
+		int now = (send_length - tx_len > 512) ? 512 : send_length - tx_len;
+		int rc = ftdi_write_data(&mpsse_ftdic, tx_buffer + tx_len, now);
+		mpsse_stats.usb_writes++;
+		if (rc != now) {
+			fprintf(stderr, "Write error (rc=%d, expected %d)[%s]\n", rc, now, ftdi_get_error_string(&mpsse_ftdic));
+			mpsse_error(2);
+		}
+		tx_len += now;
+
+		if (rx_len < receive_length) {
+			rc = ftdi_read_data(&mpsse_ftdic, rx_buffer + rx_len, receive_length - rx_len);
+			mpsse_stats.usb_reads++;
+			if (rc < 0) {
+				fprintf(stderr, "Read error (rc=%d)[%s]\n", rc, ftdi_get_error_string(&mpsse_ftdic));
+				mpsse_error(2);
+			}
+			rx_len += rc;
+		}
+	}
+
+	while (rx_len != receive_length) {
+		int rc = ftdi_read_data(&mpsse_ftdic, rx_buffer + rx_len, receive_length - rx_len);
+		mpsse_stats.usb_reads++;
+		if (rc < 0) {
+			fprintf(stderr, "Read error (rc=%d)[%s]\n", rc, ftdi_get_error_string(&mpsse_ftdic));
+			mpsse_error(2);
+		}
+		rx_len += rc;
+	}
+#endif
+
+	mpsse_stats.bytes_out += send_length;
+	mpsse_stats.bytes_in += receive_length;
+	if (receive_length)
+		mpsse_stats.round_trips++;
+	mpsse_stats.blocked += mpsse_time() - start;
+	trace_end_xfer(send_length, receive_length);
+}
+
+#if defined(FTDI_MAJOR_VERSION) && (FTDI_MAJOR_VERSION >= 1)
+static struct ftdi_transfer_control *writes[MPSSE_WRITES_IN_FLIGHT];
+static uint32_t write_lengths[MPSSE_WRITES_IN_FLIGHT];
+static unsigned write_head, writes_queued;
+
+static void mpsse_write_wait(void)
+{
+	unsigned idx = (write_head + MPSSE_WRITES_IN_FLIGHT - writes_queued) % MPSSE_WRITES_IN_FLIGHT;
+	double start = mpsse_time();
+	trace_begin("usb write wait");
+	int rc = ftdi_transfer_data_done(writes[idx]);
+	trace_end_xfer(write_lengths[idx], 0);
+	mpsse_stats.blocked += mpsse_time() - start;
+	if (rc != write_lengths[idx]) {
+		fprintf(stderr, "Write error (rc=%d, expected %u)[%s]\n", rc, write_lengths[idx], ftdi_get_error_string(&mpsse_ftdic));
+		mpsse_error(2);
+	}
+	writes_queued--;
+}
+#endif
+
+/* Write-only commands (nothing is read back), queued so the FTDI never
+ * waits for the host between USB transfers. Any transfer that expects a
+ * reply waits for the queue to drain first. */
+static void adapter_write_stream(uint8_t *tx_buffer, uint32_t send_length)
+{
+	mpsse_stats.usb_writes++;
+	mpsse_stats.bytes_out += send_length;
+	trace_begin("mpsse_write_stream");
+
+#if defined(FTDI_MAJOR_VERSION) && (FTDI_MAJOR_VERSION >= 1)
+	if (writes_queued == MPSSE_WRITES_IN_FLIGHT)
+		mpsse_write_wait();
+
+	writes[write_head] = ftdi_write_data_submit(&mpsse_ftdic, tx_buffer, send_length);
+	if (writes[write_head] == NULL) {
+		fprintf(stderr, "Write submit error [%s]\n", ftdi_get_error_string(&mpsse_ftdic));
+		mpsse_error(2);
+	}
+	write_lengths[write_head] = send_length;
+	write_head = (write_head + 1) % MPSSE_WRITES_IN_FLIGHT;
+	writes_queued++;
+#else
+	int rc = ftdi_write_data(&mpsse_ftdic, tx_buffer, send_length);
+	if (rc != send_length) {
+		fprintf(stderr, "Write error (rc=%d, expected %u)[%s]\n", rc, send_length, ftdi_get_error_string(&mpsse_ftdic));
+		mpsse_error(2);
+	}
+#endif
+	trace_end_xfer(send_length, 0);
+}
+
+static void adapter_write_flush(void)
+{
+#if defined(FTDI_MAJOR_VERSION) && (FTDI_MAJOR_VERSION >= 1)
+	while (writes_queued)
+		mpsse_write_wait();
+#endif
+}
+
+static void adapter_init(int ifnum, const char *devstr, int clkdiv)
 {
 	enum ftdi_interface ftdi_ifnum = INTERFACE_A;
 
@@ -216,7 +398,7 @@ void mpsse_init(int ifnum, const char *devstr, int clkdiv)
 
 	mpsse_send_byte(MC_TCK_X5);
 
-        // set clock - actual clock is 6MHz/(clkdiv)
+        // set clock - actual clock is 30MHz/(clkdiv), see MPSSE_TCK_HZ
         mpsse_send_byte(MC_SET_CLK_DIV);
         mpsse_send_byte((clkdiv-1) & 0xff);
         mpsse_send_byte((clkdiv-1) >> 8);
@@ -230,10 +412,92 @@ void mpsse_init(int ifnum, const char *devstr, int clkdiv)
 	mpsse_send_byte(0x00); /* Direction */
 }
 
-void mpsse_close(void)
+static void adapter_sleep(uint32_t us)
 {
+	usleep(us);
+}
+
+static void adapter_close(void)
+{
+	mpsse_write_flush();
 	ftdi_set_latency_timer(&mpsse_ftdic, mpsse_ftdi_latency);
 	//ftdi_disable_bitbang(&mpsse_ftdic);
 	ftdi_usb_close(&mpsse_ftdic);
 	ftdi_deinit(&mpsse_ftdic);
 }
+
+// ---------------------------------------------------------
+// Backend dispatch
+// ---------------------------------------------------------
+
+static const struct mpsse_backend adapter = {
+	.init = adapter_init,
+	.close = adapter_close,
+	.abort = adapter_abort,
+	.recv_byte = adapter_recv_byte,
+	.send_byte = adapter_send_byte,
+	.xfer = adapter_xfer,
+	.xfer_stream = adapter_xfer_stream,
+	.write_stream = adapter_write_stream,
+	.write_flush = adapter_write_flush,
+	.sleep = adapter_sleep,
+};
+
+static const struct mpsse_backend *backend = &adapter;
+
+void mpsse_set_backend(const struct mpsse_backend *b)
+{
+	backend = b;
+}
+
+void mpsse_error(int status)
+{
+	fprintf(stderr, "ABORT.\n");
+	backend->abort();
+	exit(status);
+}
+
+uint8_t mpsse_recv_byte()
+{
+	return backend->recv_byte();
+}
+
+void mpsse_send_byte(uint8_t data)
+{
+	backend->send_byte(data);
+}
+
+void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length)
+{
+	backend->xfer(data_buffer, send_length, receive_length);
+}
+
+void mpsse_xfer_stream(uint8_t *tx_buffer, uint32_t send_length, uint8_t *rx_buffer, uint32_t receive_length)
+{
+	backend->xfer_stream(tx_buffer, send_length, rx_buffer, receive_length);
+}
+
+void mpsse_write_stream(uint8_t *tx_buffer, uint32_t send_length)
+{
+	backend->write_stream(tx_buffer, send_length);
+}
+
+void mpsse_write_flush(void)
+{
+	backend->write_flush();
+}
+
+void mpsse_sleep(uint32_t us)
+{
+	backend->sleep(us);
+}
+
+void mpsse_init(int ifnum, const char *devstr, int clkdiv)
+{
+	backend->init(ifnum, devstr, clkdiv);
+}
+
+void mpsse_close(void)
+{
+	backend->close();
+}
@@ -99,12 +99,55 @@ enum mpsse_cmd
 #define MC_DATA_BITS (0x02) /* When set count bits not bytes */
 #define MC_DATA_OCN  (0x01) /* When set update data on negative clock edge */
 
+/* mpsse_write_stream() keeps up to this many USB writes queued; a buffer
+ * may only be reused once that many later writes have been submitted */
+#define MPSSE_WRITES_IN_FLIGHT 4
+
+/* With the 60 MHz master clock (MC_TCK_X5), TCK runs at half of it divided
+ * by the divider passed to mpsse_init() */
+#define MPSSE_TCK_HZ(clkdiv) (30000000 / (clkdiv))
+
+
+/* What the transport did since mpsse_init(), for --stats */
+struct mpsse_stats {
+	uint64_t usb_writes;
+	uint64_t usb_reads;   /* read calls, including polls that return nothing */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t round_trips; /* transfers that waited for a reply */
+	double blocked;       /* seconds spent waiting on the adapter */
+};
+
+extern struct mpsse_stats mpsse_stats;
+
+/* What the functions below run on: the FTDI adapter, unless
+ * mpsse_set_backend() put something else in its place, such as the cost
+ * model of --dry-run. 'abort' releases the device before mpsse_error()
+ * exits, 'sleep' waits for the device without talking to it. */
+struct mpsse_backend {
+	void (*init)(int ifnum, const char *devstr, int clkdiv);
+	void (*close)(void);
+	void (*abort)(void);
+	uint8_t (*recv_byte)(void);
+	void (*send_byte)(uint8_t data);
+	void (*xfer)(uint8_t *data_buffer, uint16_t send_length, uint16_t receive_length);
+	void (*xfer_stream)(uint8_t *tx_buffer, uint32_t send_length, uint8_t *rx_buffer, uint32_t receive_length);
+	void (*write_stream)(uint8_t *tx_buffer, uint32_t send_length);
+	void (*write_flush)(void);
+	void (*sleep)(uint32_t us);
+};
+
+void mpsse_set_backend(const struct mpsse_backend *backend);
 
 void mpsse_check_rx(void);
 void mpsse_error(int status);
 uint8_t mpsse_recv_byte(void);
 void mpsse_xfer(uint8_t* data_buffer, uint16_t send_length, uint16_t receive_length);
+void mpsse_xfer_stream(uint8_t *tx_buffer, uint32_t send_length, uint8_t *rx_buffer, uint32_t receive_length);
+void mpsse_write_stream(uint8_t *tx_buffer, uint32_t send_length);
+void mpsse_write_flush(void);
 void mpsse_send_byte(uint8_t data);
+void mpsse_sleep(uint32_t us);
 void mpsse_send_spi(uint8_t *data, int n);
 void mpsse_xfer_spi(uint8_t *data, int n);
 uint8_t mpsse_xfer_spi_bits(uint8_t data, int n);
@@ -0,0 +1,137 @@
+/*
+ * Producer/consumer stage, see pipeline.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+
+#define PIPE_DEPTH 2
+
+struct pipe {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pipe_sink_t sink;
+	void *ctx;
+
+	uint8_t *buffer[PIPE_DEPTH];
+	uint32_t length[PIPE_DEPTH];
+	unsigned head;   /* next buffer handed out to the producer */
+	unsigned tail;   /* next buffer to be consumed */
+	unsigned filled; /* buffers pushed and not yet consumed */
+	bool closing;
+	int status;
+};
+
+static void *pipe_thread(void *arg)
+{
+	struct pipe *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->filled && !p->closing)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (!p->filled)
+			break;
+
+		unsigned idx = p->tail;
+		pthread_mutex_unlock(&p->lock);
+
+		int rc = 0;
+		if (p->status == 0)
+			rc = p->sink(p->ctx, p->buffer[idx], p->length[idx]);
+
+		pthread_mutex_lock(&p->lock);
+		if (rc && !p->status)
+			p->status = rc;
+		p->tail = (p->tail + 1) % PIPE_DEPTH;
+		p->filled--;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+struct pipe *pipe_open(uint32_t buffer_size, pipe_sink_t sink, void *ctx)
+{
+	struct pipe *p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	for (int i = 0; i < PIPE_DEPTH; i++) {
+		p->buffer[i] = malloc(buffer_size);
+		if (!p->buffer[i])
+			goto fail;
+	}
+
+	p->sink = sink;
+	p->ctx = ctx;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->thread, NULL, pipe_thread, p)) {
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+		goto fail;
+	}
+	return p;
+
+fail:
+	for (int i = 0; i < PIPE_DEPTH; i++)
+		free(p->buffer[i]);
+	free(p);
+	return NULL;
+}
+
+uint8_t *pipe_buffer(struct pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	/* The buffer at 'head' is free once it is neither queued nor being consumed */
+	while (p->filled == PIPE_DEPTH)
+		pthread_cond_wait(&p->cond, &p->lock);
+	uint8_t *buf = p->buffer[p->head];
+	pthread_mutex_unlock(&p->lock);
+	return buf;
+}
+
+void pipe_push(struct pipe *p, uint32_t len)
+{
+	pthread_mutex_lock(&p->lock);
+	p->length[p->head] = len;
+	p->head = (p->head + 1) % PIPE_DEPTH;
+	p->filled++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+bool pipe_failed(struct pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	bool failed = p->status != 0;
+	pthread_mutex_unlock(&p->lock);
+	return failed;
+}
+
+int pipe_close(struct pipe *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->closing = true;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->thread, NULL);
+
+	int status = p->status;
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	for (int i = 0; i < PIPE_DEPTH; i++)
+		free(p->buffer[i]);
+	free(p);
+	return status;
+}
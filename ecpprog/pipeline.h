@@ -0,0 +1,47 @@
+/*
+ * A small producer/consumer stage for overlapping JTAG traffic with host work.
+ *
+ * The producer (normally the thread talking to the FTDI) fills fixed-size
+ * buffers and pushes them; a second thread hands each buffer to the sink in
+ * order. Two buffers are used, so one can be filled while the other is consumed.
+ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Called on the consumer thread for every pushed buffer, in order.
+ * A non-zero return value stops the stage, later buffers are dropped. */
+typedef int (*pipe_sink_t)(void *ctx, const uint8_t *data, uint32_t len);
+
+struct pipe;
+
+/**
+ * Starts the consumer thread. Returns NULL on failure.
+ */
+struct pipe *pipe_open(uint32_t buffer_size, pipe_sink_t sink, void *ctx);
+
+/**
+ * Returns the next free buffer, blocking while both are in use by the sink.
+ */
+uint8_t *pipe_buffer(struct pipe *p);
+
+/**
+ * Hands the buffer from the last pipe_buffer() call to the sink.
+ */
+void pipe_push(struct pipe *p, uint32_t len);
+
+/**
+ * True once the sink has returned an error.
+ */
+bool pipe_failed(struct pipe *p);
+
+/**
+ * Waits for all pushed buffers to be consumed, stops the thread and frees the
+ * stage. Returns the first non-zero sink result, or 0.
+ */
+int pipe_close(struct pipe *p);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Progress events, see progress.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "progress.h"
+#include "trace.h"
+
+static callback_t listener;
+static int depth;
+static struct progress state;
+static double start_time, last_time;
+static uint64_t last_done;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void emit(double t)
+{
+	if (t > last_time)
+		state.rate = (state.done - last_done) / (t - last_time);
+	if (t > start_time)
+		state.avg_rate = state.done / (t - start_time);
+	state.elapsed = t - start_time;
+	state.eta = (state.total && state.avg_rate > 0) ? (state.total - state.done) / state.avg_rate : -1;
+
+	last_time = t;
+	last_done = state.done;
+	listener(&state);
+}
+
+void progress_listen(callback_t cb)
+{
+	listener = cb;
+}
+
+void progress_start(enum progress_phase phase, const char *label, uint64_t total, uint64_t addr)
+{
+	trace_begin(label);
+	if (depth++)
+		return;
+
+	state = (struct progress){ .phase = phase, .label = label, .total = total, .addr = addr, .eta = -1 };
+	start_time = last_time = now();
+	last_done = 0;
+	if (listener)
+		emit(start_time);
+}
+
+void progress_update(uint64_t done, uint64_t addr)
+{
+	if (depth != 1)
+		return;
+
+	state.done = done;
+	state.addr = addr;
+	if (!listener)
+		return;
+
+	double t = now();
+	if ((t - last_time) * 1000 >= PROGRESS_INTERVAL_MS)
+		emit(t);
+}
+
+void progress_end(void)
+{
+	if (!depth)
+		return;
+	if (--depth) {
+		trace_end();
+		return;
+	}
+
+	trace_end_bytes(state.done);
+	state.end = true;
+	if (listener)
+		emit(now());
+}
+
+void progress_print(const struct progress *p)
+{
+	fprintf(stderr, "\r\033[0K%-15s%04" PRIu64, p->label, p->done);
+	if (p->total)
+		fprintf(stderr, "/%04" PRIu64, p->total);
+
+	double rate = p->end ? p->avg_rate : p->rate;
+	if (rate > 0)
+		fprintf(stderr, "  %.0f kB/s", rate / 1024);
+	if (!p->end && p->eta >= 0)
+		fprintf(stderr, "  %.0f s left", p->eta);
+}
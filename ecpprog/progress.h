@@ -0,0 +1,55 @@
+/*
+ * Progress of the long running flash operations
+ *
+ * The loops doing the work report every page or chunk. Listeners get an
+ * event when a phase starts and ends, and at most every
+ * PROGRESS_INTERVAL_MS in between, so a report costs the loop no more than
+ * reading the clock.
+ */
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROGRESS_INTERVAL_MS 100
+
+enum progress_phase {
+	PROGRESS_ERASE,
+	PROGRESS_PROGRAM,
+	PROGRESS_VERIFY,
+	PROGRESS_READ,
+};
+
+struct progress {
+	enum progress_phase phase;
+	const char *label; /* for display, e.g. "programming.." */
+	uint64_t done;     /* bytes */
+	uint64_t total;    /* 0 if not known in advance */
+	uint64_t addr;     /* flash address reached */
+	double rate;       /* bytes/s since the previous event */
+	double avg_rate;   /* bytes/s since the phase started */
+	double eta;        /* seconds left, negative if unknown */
+	double elapsed;    /* seconds since the phase started */
+	bool end;          /* last event of the phase */
+};
+
+typedef void (*callback_t)(const struct progress *p);
+
+/* Sends the events to 'cb', NULL to drop them */
+void progress_listen(callback_t cb);
+
+/* Starts a phase of 'total' bytes at flash address 'addr'. A phase started
+ * while another one runs is part of it and isn't reported on its own. */
+void progress_start(enum progress_phase phase, const char *label, uint64_t total, uint64_t addr);
+
+/* 'done' bytes of the phase are complete, up to flash address 'addr' */
+void progress_update(uint64_t done, uint64_t addr);
+
+void progress_end(void);
+
+/* Listener drawing a status line on stderr. The caller ends the line. */
+void progress_print(const struct progress *p);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Timing report, see report.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "report.h"
+#include "mpsse.h"
+
+static const char *phase_names[REPORT_PHASES] = {
+	[REPORT_USB_INIT] = "usb_init",
+	[REPORT_IDENTIFY] = "identify",
+	[REPORT_FLASH_RESET] = "flash_reset",
+	[REPORT_ERASE] = "erase",
+	[REPORT_PROGRAM] = "program",
+	[REPORT_VERIFY] = "verify",
+	[REPORT_READ] = "read",
+	[REPORT_SRAM] = "sram",
+	[REPORT_REFRESH] = "refresh",
+};
+
+static struct {
+	unsigned count;
+	double seconds;
+	uint64_t bytes;
+} phases[REPORT_PHASES];
+
+struct erase_block {
+	uint64_t addr;
+	uint32_t size;
+	double seconds;
+};
+
+static struct erase_block *blocks;
+static size_t block_count, block_space;
+
+double report_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void add(enum report_phase phase, double seconds, uint64_t bytes)
+{
+	phases[phase].count++;
+	phases[phase].seconds += seconds;
+	phases[phase].bytes += bytes;
+}
+
+void report_add(enum report_phase phase, double start, uint64_t bytes)
+{
+	add(phase, report_time() - start, bytes);
+}
+
+void report_progress(const struct progress *p)
+{
+	static const enum report_phase map[] = {
+		[PROGRESS_ERASE] = REPORT_ERASE,
+		[PROGRESS_PROGRAM] = REPORT_PROGRAM,
+		[PROGRESS_VERIFY] = REPORT_VERIFY,
+		[PROGRESS_READ] = REPORT_READ,
+	};
+
+	if (p->end)
+		add(map[p->phase], p->elapsed, p->done);
+}
+
+void report_erase_block(uint64_t addr, uint32_t size, double start)
+{
+	if (block_count == block_space) {
+		size_t space = block_space ? 2 * block_space : 64;
+		struct erase_block *b = realloc(blocks, space * sizeof(*b));
+		if (!b)
+			return;
+		blocks = b;
+		block_space = space;
+	}
+	blocks[block_count++] = (struct erase_block){ addr, size, report_time() - start };
+}
+
+static double rate(uint64_t bytes, double seconds)
+{
+	return seconds > 0 ? bytes / seconds : 0;
+}
+
+int report_write(const char *path, const struct report_info *info)
+{
+	FILE *f = path ? fopen(path, "w") : stdout;
+	if (!f)
+		return -1;
+
+	fprintf(f, "{\"result\":\"%s\",\"seconds\":%.6f", info->ok ? "ok" : "failed", report_time() - info->start);
+	fprintf(f, ",\"clock_divider\":%d,\"tck_hz\":%d", info->clkdiv, info->clkdiv ? MPSSE_TCK_HZ(info->clkdiv) : 0);
+	if (info->idcode)
+		fprintf(f, ",\"idcode\":\"0x%08" PRIx32 "\"", info->idcode);
+	if (info->device)
+		fprintf(f, ",\"device\":\"%s\"", info->device);
+	if (info->unique_id)
+		fprintf(f, ",\"unique_id\":\"%016" PRIx64 "\"", info->unique_id);
+	if (info->jedec_id)
+		fprintf(f, ",\"flash\":{\"jedec_id\":\"0x%06" PRIx32 "\",\"size\":%" PRIu64 "}", info->jedec_id, info->flash_size);
+
+	fprintf(f, ",\"phases\":{");
+	const char *sep = "";
+	for (int i = 0; i < REPORT_PHASES; i++) {
+		if (!phases[i].count)
+			continue;
+		fprintf(f, "%s\"%s\":{\"count\":%u,\"seconds\":%.6f,\"bytes\":%" PRIu64 ",\"bytes_per_s\":%.0f}",
+			sep, phase_names[i], phases[i].count, phases[i].seconds, phases[i].bytes,
+			rate(phases[i].bytes, phases[i].seconds));
+		sep = ",";
+	}
+
+	fprintf(f, "},\"erase_blocks\":[");
+	for (size_t i = 0; i < block_count; i++)
+		fprintf(f, "%s{\"addr\":%" PRIu64 ",\"size\":%" PRIu32 ",\"seconds\":%.6f}",
+			i ? "," : "", blocks[i].addr, blocks[i].size, blocks[i].seconds);
+	fprintf(f, "]}\n");
+
+	if (path)
+		return fclose(f) ? -1 : 0;
+	return fflush(f) ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Timing report of a run, written as JSON with --report.
+ *
+ * Each phase accumulates how often it ran, the wall time spent in it and
+ * the bytes it moved. Erased blocks are listed one by one, so slow or
+ * degrading flash parts stand out.
+ */
+
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "progress.h"
+
+enum report_phase {
+	REPORT_USB_INIT,
+	REPORT_IDENTIFY,
+	REPORT_FLASH_RESET,
+	REPORT_ERASE,
+	REPORT_PROGRAM,
+	REPORT_VERIFY,
+	REPORT_READ,
+	REPORT_SRAM,
+	REPORT_REFRESH,
+	REPORT_PHASES
+};
+
+/* What the run was talking to, 0 or NULL where unknown */
+struct report_info {
+	bool ok;              /* the run completed */
+	double start;         /* report_time() when it began */
+	int clkdiv;
+	uint32_t idcode;
+	const char *device;
+	uint64_t unique_id;
+	uint32_t jedec_id;
+	uint64_t flash_size;
+};
+
+/* Monotonic time in seconds, to pass as 'start' below */
+double report_time(void);
+
+/* Adds the time since 'start' and 'bytes' to 'phase' */
+void report_add(enum report_phase phase, double start, uint64_t bytes);
+
+/* Adds the erase, program and readback phases as their last event comes in */
+void report_progress(const struct progress *p);
+
+/* Records the erase of the block at 'addr', started at 'start' */
+void report_erase_block(uint64_t addr, uint32_t size, double start);
+
+/* Writes the report to 'path', stdout if NULL. Returns 0 on success. */
+int report_write(const char *path, const struct report_info *info);
+
+#endif
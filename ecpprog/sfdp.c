@@ -0,0 +1,337 @@
+/*
+ * SFDP (JESD216) parsing and caching, see sfdp.h
+ *
+ *  Relevant Documents:
+ *  -------------------
+ *  JEDEC JESD216D, Serial Flash Discoverable Parameters
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfdp.h"
+#include "cache.h"
+
+#define SFDP_SIGNATURE     0x50444653 /* "SFDP", little endian */
+#define SFDP_ID_BFPT       0xFF00     /* Basic Flash Parameter Table */
+#define SFDP_ID_4BAIT      0xFF84     /* 4-byte Address Instruction Table */
+#define SFDP_BFPT_MAX_DW   23
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void sfdp_defaults(struct flash_info *info, uint32_t jedec_id)
+{
+	memset(info, 0, sizeof(*info));
+	info->jedec_id = jedec_id;
+	info->page_size = 256;
+	info->addr_mode = SFDP_ADDR_3;
+
+	info->erase[0].size = 4 * 1024;
+	info->erase[0].opcode = 0x20;
+	info->erase[1].size = 32 * 1024;
+	info->erase[1].opcode = 0x52;
+	info->erase[2].size = 64 * 1024;
+	info->erase[2].opcode = 0xD8;
+
+	/* Flashes without 4BAIT switch to 4-byte mode with 0xB7 */
+	info->enter_4b = SFDP_4B_B7;
+	info->exit_4b = SFDP_4B_B7;
+}
+
+static void sort_erase_types(struct flash_info *info)
+{
+	/* Unused slots (size 0) go to the end */
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+		for (int j = i + 1; j < SFDP_ERASE_TYPES; j++) {
+			struct flash_erase_type *a = &info->erase[i], *b = &info->erase[j];
+			if ((a->size == 0 && b->size != 0) || (b->size != 0 && b->size < a->size)) {
+				struct flash_erase_type t = *a;
+				*a = *b;
+				*b = t;
+			}
+		}
+	}
+}
+
+static void parse_bfpt(struct flash_info *info, const uint32_t *dw, int ndw)
+{
+	/* 1st DWORD: address bytes and dual fast read support */
+	info->addr_mode = (dw[0] >> 17) & 3;
+	if (info->addr_mode > SFDP_ADDR_4)
+		info->addr_mode = SFDP_ADDR_3;
+
+	/* 2nd DWORD: density in bits */
+	if (dw[1] & 0x80000000) {
+		uint32_t n = dw[1] & 0x7FFFFFFF;
+		info->size = (n >= 32 && n < 67) ? (1ULL << (n - 3)) : 0;
+	} else {
+		info->size = ((uint64_t)dw[1] + 1) / 8;
+	}
+
+	/* 3rd/4th DWORD: 1-1-4 and 1-1-2 fast read opcodes */
+	if (dw[0] & (1 << 22))
+		info->read_114 = dw[2] >> 24;
+	if (dw[0] & (1 << 16))
+		info->read_112 = dw[3] >> 8;
+
+	/* 8th/9th DWORD: erase types, size is 2^N bytes */
+	if (ndw >= 9) {
+		for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+			uint32_t v = dw[7 + i / 2] >> (16 * (i & 1));
+			uint8_t n = v & 0xFF;
+			info->erase[i].size = (n >= 8 && n < 32) ? (1U << n) : 0;
+			info->erase[i].opcode = (v >> 8) & 0xFF;
+			info->erase[i].opcode_4b = 0;
+			info->erase[i].typ_ms = 0;
+			info->erase[i].max_ms = 0;
+		}
+	}
+
+	/* 10th DWORD: typical erase times, and the multiplier for the maximum */
+	if (ndw >= 10) {
+		static const uint32_t unit_ms[4] = { 1, 16, 128, 1000 };
+		uint32_t mult = 2 * ((dw[9] & 0xF) + 1);
+
+		for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+			uint32_t v = (dw[9] >> (4 + 7 * i)) & 0x7F;
+			if (!info->erase[i].size)
+				continue;
+			info->erase[i].typ_ms = ((v & 0x1F) + 1) * unit_ms[v >> 5];
+			info->erase[i].max_ms = info->erase[i].typ_ms * mult;
+		}
+	}
+
+	/* 11th DWORD: page size, page program and chip erase times */
+	if (ndw >= 11) {
+		static const uint32_t chip_unit_ms[4] = { 16, 256, 4000, 64000 };
+		uint32_t mult = 2 * ((dw[10] & 0xF) + 1);
+		uint32_t n = (dw[10] >> 4) & 0xF;
+		uint32_t pp = (dw[10] >> 8) & 0x3F;
+		uint32_t ce = (dw[10] >> 24) & 0x7F;
+
+		info->page_size = 1U << n;
+		info->page_typ_us = ((pp & 0x1F) + 1) * ((pp & 0x20) ? 64 : 8);
+		info->page_max_us = info->page_typ_us * mult;
+		info->chip_typ_ms = ((ce & 0x1F) + 1) * chip_unit_ms[ce >> 5];
+	}
+
+	/* 16th DWORD: how to enter and exit 4-byte address mode */
+	if (ndw >= 16) {
+		uint8_t enter = dw[15] >> 24;
+		uint16_t exit = (dw[15] >> 14) & 0x3FF;
+
+		info->enter_4b = enter & (SFDP_4B_B7 | SFDP_4B_WE_B7);
+		info->exit_4b = exit & (SFDP_4B_B7 | SFDP_4B_WE_B7);
+	}
+}
+
+static void parse_4bait(struct flash_info *info, const uint32_t *dw)
+{
+	/* 1st DWORD: which instructions exist, 2nd DWORD: erase opcodes */
+	if (dw[0] & (1 << 0))
+		info->read_4b = 0x13;
+	if (dw[0] & (1 << 6))
+		info->pp_4b = 0x12;
+
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++)
+		if (dw[0] & (1 << (9 + i)))
+			info->erase[i].opcode_4b = dw[1] >> (8 * i);
+}
+
+int sfdp_parse(struct flash_info *info, sfdp_read_t read)
+{
+	uint8_t hdr[8];
+
+	read(0, hdr, sizeof(hdr));
+	if (get_le32(hdr) != SFDP_SIGNATURE)
+		return -1;
+
+	int nph = hdr[6] + 1;
+	bool found = false;
+	uint32_t bait[2];
+	bool have_bait = false;
+
+	for (int i = 0; i < nph; i++) {
+		uint8_t ph[8];
+		read(8 + 8 * i, ph, sizeof(ph));
+
+		uint16_t id = ph[0] | (ph[7] << 8);
+		uint32_t ptr = ph[4] | (ph[5] << 8) | (ph[6] << 16);
+		int ndw = ph[3];
+
+		if (id == SFDP_ID_BFPT && !found) {
+			uint8_t raw[SFDP_BFPT_MAX_DW * 4];
+			uint32_t dw[SFDP_BFPT_MAX_DW];
+
+			if (ndw < 9)
+				return -1;
+			if (ndw > SFDP_BFPT_MAX_DW)
+				ndw = SFDP_BFPT_MAX_DW;
+
+			read(ptr, raw, ndw * 4);
+			for (int j = 0; j < ndw; j++)
+				dw[j] = get_le32(raw + 4 * j);
+
+			parse_bfpt(info, dw, ndw);
+			found = true;
+		} else if (id == SFDP_ID_4BAIT && ndw >= 2 && !have_bait) {
+			uint8_t raw[8];
+
+			read(ptr, raw, sizeof(raw));
+			bait[0] = get_le32(raw);
+			bait[1] = get_le32(raw + 4);
+			have_bait = true;
+		}
+	}
+
+	if (!found)
+		return -1;
+
+	/* Erase opcodes in the 4BAIT refer to the BFPT erase type order */
+	if (have_bait)
+		parse_4bait(info, bait);
+	sort_erase_types(info);
+
+	info->from_sfdp = true;
+	return 0;
+}
+
+static void cache_name(char *name, size_t len, uint32_t jedec_id)
+{
+	snprintf(name, len, "sfdp-%06x.txt", jedec_id);
+}
+
+int sfdp_cache_load(struct flash_info *info, uint32_t jedec_id)
+{
+	char name[32], line[128];
+	int erase = 0;
+
+	cache_name(name, sizeof(name), jedec_id);
+	FILE *f = cache_fopen(name, "r");
+	if (!f)
+		return -1;
+
+	sfdp_defaults(info, jedec_id);
+	memset(info->erase, 0, sizeof(info->erase));
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long v;
+		unsigned a, b, c, d, e;
+
+		if (sscanf(line, "size %llu", &v) == 1)
+			info->size = v;
+		else if (sscanf(line, "page_size %u", &a) == 1)
+			info->page_size = a;
+		else if (sscanf(line, "addr_mode %u", &a) == 1)
+			info->addr_mode = a;
+		else if (sscanf(line, "page_time %u %u", &a, &b) == 2) {
+			info->page_typ_us = a;
+			info->page_max_us = b;
+		} else if (sscanf(line, "chip_time %u", &a) == 1)
+			info->chip_typ_ms = a;
+		else if (sscanf(line, "read %x %x", &a, &b) == 2) {
+			info->read_112 = a;
+			info->read_114 = b;
+		} else if (sscanf(line, "4byte %x %x %x %x", &a, &b, &c, &d) == 4) {
+			info->read_4b = a;
+			info->pp_4b = b;
+			info->enter_4b = c;
+			info->exit_4b = d;
+		} else if (sscanf(line, "erase %u %x %u %u %x", &a, &b, &c, &d, &e) == 5 && erase < SFDP_ERASE_TYPES) {
+			info->erase[erase].size = a;
+			info->erase[erase].opcode = b;
+			info->erase[erase].typ_ms = c;
+			info->erase[erase].max_ms = d;
+			info->erase[erase].opcode_4b = e;
+			erase++;
+		}
+	}
+	fclose(f);
+
+	/* Don't trust a truncated file */
+	if (!erase || !info->page_size || (info->page_size & (info->page_size - 1))) {
+		sfdp_defaults(info, jedec_id);
+		return -1;
+	}
+
+	info->from_sfdp = true;
+	return 0;
+}
+
+void sfdp_cache_save(const struct flash_info *info)
+{
+	char name[32];
+
+	cache_name(name, sizeof(name), info->jedec_id);
+	FILE *f = cache_fopen(name, "w");
+	if (!f)
+		return;
+
+	fprintf(f, "# ecpprog SFDP cache for JEDEC ID %06x\n", info->jedec_id);
+	fprintf(f, "size %llu\n", (unsigned long long)info->size);
+	fprintf(f, "page_size %u\n", info->page_size);
+	fprintf(f, "addr_mode %u\n", info->addr_mode);
+	fprintf(f, "page_time %u %u\n", info->page_typ_us, info->page_max_us);
+	fprintf(f, "chip_time %u\n", info->chip_typ_ms);
+	fprintf(f, "read %02x %02x\n", info->read_112, info->read_114);
+	fprintf(f, "4byte %02x %02x %02x %02x\n", info->read_4b, info->pp_4b, info->enter_4b, info->exit_4b);
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+		const struct flash_erase_type *e = &info->erase[i];
+		if (e->size)
+			fprintf(f, "erase %u %02x %u %u %02x\n", e->size, e->opcode, e->typ_ms, e->max_ms, e->opcode_4b);
+	}
+	fclose(f);
+}
+
+const struct flash_erase_type *sfdp_erase_type(const struct flash_info *info, uint32_t size, bool need_4b)
+{
+	const struct flash_erase_type *best = NULL;
+
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+		const struct flash_erase_type *e = &info->erase[i];
+		if (!e->size || e->size > size || (need_4b && !e->opcode_4b))
+			continue;
+		if (!best || e->size > best->size)
+			best = e;
+	}
+	return best;
+}
+
+void sfdp_print(const struct flash_info *info, bool verbose)
+{
+	if (!info->from_sfdp)
+		return;
+
+	fprintf(stderr, "flash: %llu kB, %u byte pages, %s addressing, erase",
+		(unsigned long long)(info->size >> 10), info->page_size,
+		info->addr_mode == SFDP_ADDR_3 ? "3-byte" :
+		info->addr_mode == SFDP_ADDR_4 ? "4-byte" : "3/4-byte");
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++)
+		if (info->erase[i].size)
+			fprintf(stderr, " %ukB", info->erase[i].size >> 10);
+	fprintf(stderr, "\n");
+
+	if (!verbose)
+		return;
+
+	for (int i = 0; i < SFDP_ERASE_TYPES; i++) {
+		const struct flash_erase_type *e = &info->erase[i];
+		if (e->size)
+			fprintf(stderr, "  erase %4ukB: opcode 0x%02X (4-byte 0x%02X), typ %u ms, max %u ms\n",
+				e->size >> 10, e->opcode, e->opcode_4b, e->typ_ms, e->max_ms);
+	}
+	if (info->read_4b || info->pp_4b)
+		fprintf(stderr, "  4-byte read 0x%02X, page program 0x%02X\n", info->read_4b, info->pp_4b);
+	fprintf(stderr, "  page program: typ %u us, max %u us\n", info->page_typ_us, info->page_max_us);
+	fprintf(stderr, "  chip erase:   typ %u ms\n", info->chip_typ_ms);
+	if (info->read_112)
+		fprintf(stderr, "  1-1-2 fast read: opcode 0x%02X\n", info->read_112);
+	if (info->read_114)
+		fprintf(stderr, "  1-1-4 fast read: opcode 0x%02X\n", info->read_114);
+}
@@ -0,0 +1,84 @@
+/*
+ * Serial Flash Discoverable Parameters (JESD216)
+ *
+ * Describes the geometry and timing of the SPI flash behind the FPGA, either
+ * parsed from the flash itself or taken from the per-JEDEC-ID cache.
+ */
+
+#ifndef __SFDP_H__
+#define __SFDP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SFDP_ERASE_TYPES 4
+
+struct flash_erase_type {
+	uint32_t size;    /* bytes, 0 if this slot is unused */
+	uint8_t  opcode;
+	uint8_t  opcode_4b; /* with a 4-byte address, 0 if unsupported */
+	uint32_t typ_ms;  /* 0 if unknown */
+	uint32_t max_ms;
+};
+
+struct flash_info {
+	uint32_t jedec_id;
+	bool     from_sfdp;
+	uint64_t size;        /* bytes, 0 if unknown */
+	uint32_t page_size;
+	uint8_t  addr_mode;   /* SFDP_ADDR_* */
+	uint32_t page_typ_us; /* 0 if unknown */
+	uint32_t page_max_us;
+	uint32_t chip_typ_ms;
+	uint8_t  read_112;    /* dual/quad fast read opcodes, 0 if unsupported */
+	uint8_t  read_114;
+	uint8_t  read_4b;     /* 4-byte address instructions, 0 if unsupported */
+	uint8_t  pp_4b;
+	uint8_t  enter_4b;    /* SFDP_4B_* methods to enter/exit 4-byte mode */
+	uint8_t  exit_4b;
+	struct flash_erase_type erase[SFDP_ERASE_TYPES]; /* sorted by size */
+};
+
+enum sfdp_4b_method {
+	SFDP_4B_B7 = 1 << 0,    /* issue 0xB7 (enter) or 0xE9 (exit) */
+	SFDP_4B_WE_B7 = 1 << 1, /* same, preceded by write enable */
+};
+
+enum sfdp_addr_mode {
+	SFDP_ADDR_3 = 0,     /* 3-byte addresses only */
+	SFDP_ADDR_3_OR_4 = 1,
+	SFDP_ADDR_4 = 2,     /* 4-byte addresses only */
+};
+
+/* Reads 'len' bytes from the SFDP address space */
+typedef void (*sfdp_read_t)(uint32_t addr, uint8_t *data, uint32_t len);
+
+/**
+ * Fills in the values ecpprog used before SFDP support:
+ * 256-byte pages, 3-byte addresses and 4k/32k/64k erase with 0x20/0x52/0xD8.
+ */
+void sfdp_defaults(struct flash_info *info, uint32_t jedec_id);
+
+/**
+ * Reads and parses the SFDP tables. Fields the flash does not describe keep
+ * their previous value. Returns 0 on success, -1 if no valid SFDP was found.
+ */
+int sfdp_parse(struct flash_info *info, sfdp_read_t read);
+
+/**
+ * Cached copy of a previous sfdp_parse() for the same JEDEC ID.
+ * Returns 0 on a cache hit.
+ */
+int sfdp_cache_load(struct flash_info *info, uint32_t jedec_id);
+void sfdp_cache_save(const struct flash_info *info);
+
+/**
+ * Returns the erase type of exactly 'size' bytes, or the largest
+ * one not exceeding it. NULL if the flash has no usable erase type.
+ * With 'need_4b' only types that have a 4-byte address opcode qualify.
+ */
+const struct flash_erase_type *sfdp_erase_type(const struct flash_info *info, uint32_t size, bool need_4b);
+
+void sfdp_print(const struct flash_info *info, bool verbose);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * SHA-256 (FIPS 180-4), used to fingerprint flash contents.
+ */
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length;     /* bytes hashed so far */
+	uint8_t  block[64];
+	uint32_t used;       /* bytes pending in 'block' */
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const uint8_t *data, uint32_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_SIZE]);
+
+/* One-shot helper */
+void sha256(const uint8_t *data, uint32_t len, uint8_t digest[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * A/B image slot header, see slot.h
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "slot.h"
+
+#define JUMP 0x7E
+#define SPI_READ 0x03
+
+static const uint8_t jump_prefix[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xBD, 0xB3, JUMP, 0x00, 0x00, 0x00, SPI_READ };
+static const uint8_t record_magic[] = { 'E', 'C', 'P', 'S' };
+
+#define RECORD_SLOT (4 + SHA256_SIZE)
+#define RECORD_SIZE (sizeof(record_magic) + 2 * RECORD_SLOT)
+#define RECORD_CHECK 8
+
+void slot_header_build(uint8_t *data, const struct slot_header *h, const uint32_t addr[2])
+{
+	memset(data, 0xFF, SLOT_HEADER_SIZE);
+
+	uint32_t target = addr[h->active];
+	memcpy(data, jump_prefix, sizeof(jump_prefix));
+	data[sizeof(jump_prefix)] = target >> 16;
+	data[sizeof(jump_prefix) + 1] = target >> 8;
+	data[sizeof(jump_prefix) + 2] = target;
+
+	uint8_t *p = data + SLOT_RECORD;
+	memcpy(p, record_magic, sizeof(record_magic));
+	p += sizeof(record_magic);
+	for (int i = 0; i < 2; i++) {
+		uint32_t size = h->slots[i].size;
+		p[0] = size;
+		p[1] = size >> 8;
+		p[2] = size >> 16;
+		p[3] = size >> 24;
+		memcpy(p + 4, h->slots[i].hash, SHA256_SIZE);
+		p += RECORD_SLOT;
+	}
+
+	uint8_t check[SHA256_SIZE];
+	sha256(data + SLOT_RECORD, RECORD_SIZE, check);
+	memcpy(p, check, RECORD_CHECK);
+}
+
+void slot_header_parse(const uint8_t *data, const uint32_t addr[2], struct slot_header *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->active = -1;
+
+	if (!memcmp(data, jump_prefix, sizeof(jump_prefix))) {
+		const uint8_t *a = data + sizeof(jump_prefix);
+		uint32_t target = a[0] << 16 | a[1] << 8 | a[2];
+		for (int i = 0; i < 2; i++)
+			if (addr[i] == target)
+				h->active = i;
+	}
+
+	uint8_t check[SHA256_SIZE];
+	const uint8_t *p = data + SLOT_RECORD;
+	sha256(p, RECORD_SIZE, check);
+	if (memcmp(p, record_magic, sizeof(record_magic)) || memcmp(p + RECORD_SIZE, check, RECORD_CHECK))
+		return;
+
+	p += sizeof(record_magic);
+	for (int i = 0; i < 2; i++) {
+		h->slots[i].size = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+		memcpy(h->slots[i].hash, p + 4, SHA256_SIZE);
+		p += RECORD_SLOT;
+	}
+}
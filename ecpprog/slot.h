@@ -0,0 +1,49 @@
+/*
+ * A/B image slots
+ *
+ * Two bitstreams are kept in flash. The sector at address 0 holds a small
+ * bitstream whose JUMP command sends the ECP5 on to one of them, so
+ * switching between the slots rewrites a single 4kB sector:
+ *
+ *   0xFF padding, 0xBDB3 preamble
+ *   JUMP (0x7E), three zero bytes, SPI read opcode 0x03, 24-bit address
+ *
+ * This is the command ecppack --bootaddr emits. The configuration logic
+ * stops reading at the jump, so the rest of the sector holds a record of
+ * the image in each slot, from SLOT_RECORD on:
+ *
+ *   "ECPS", then per slot the image size and its SHA-256 (little endian)
+ *   the first 8 bytes of the SHA-256 of everything before
+ */
+
+#ifndef __SLOT_H__
+#define __SLOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sha256.h"
+
+#define SLOT_HEADER_ADDR 0
+#define SLOT_HEADER_SIZE 4096
+#define SLOT_RECORD 256
+
+struct slot_image {
+	uint32_t size; /* 0 if the slot's contents are unknown */
+	uint8_t hash[SHA256_SIZE];
+};
+
+struct slot_header {
+	int active; /* slot the jump points to, -1 if none */
+	struct slot_image slots[2];
+};
+
+/* Fills the SLOT_HEADER_SIZE bytes of 'data' with a header jumping to
+ * 'addr[h->active]' */
+void slot_header_build(uint8_t *data, const struct slot_header *h, const uint32_t addr[2]);
+
+/* Decodes the header in 'data'. Anything not recognised is reported as no
+ * active slot and unknown contents. */
+void slot_header_parse(const uint8_t *data, const uint32_t addr[2], struct slot_header *h);
+
+#endif
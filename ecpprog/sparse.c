@@ -0,0 +1,232 @@
+/*
+ * Sparse flash images, see sparse.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "sparse.h"
+
+/* Runs of 0xFF shorter than this stay inside a segment, as a new segment
+ * header would cost about as much */
+#define SPARSE_MIN_GAP 32
+
+struct sparse_writer {
+	FILE *out;
+	bool sparse;
+	bool trim;
+	uint64_t pos;      /* image offset of the next byte */
+	uint64_t end;      /* image offset after the last byte that is not 0xFF */
+	uint64_t pending;  /* 0xFF bytes held back by 'trim' in plain mode */
+	bool failed;
+};
+
+static void put_le(uint8_t *p, uint64_t v, int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint64_t get_le(const uint8_t *p, int n)
+{
+	uint64_t v = 0;
+	for (int i = n - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static int write_segment(struct sparse_writer *w, uint64_t offset, const uint8_t *data, uint32_t len)
+{
+	uint8_t header[12];
+
+	put_le(header, offset, 8);
+	put_le(header + 8, len, 4);
+	if (fwrite(header, 1, sizeof(header), w->out) != sizeof(header))
+		return -1;
+	if (len && fwrite(data, 1, len, w->out) != len)
+		return -1;
+	return 0;
+}
+
+static int write_blank(FILE *out, uint64_t len)
+{
+	static uint8_t blank[4096];
+
+	if (!blank[0])
+		memset(blank, 0xFF, sizeof(blank));
+
+	while (len) {
+		uint32_t n = (len > sizeof(blank)) ? sizeof(blank) : len;
+		if (fwrite(blank, 1, n, out) != n)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+struct sparse_writer *sparse_open(FILE *out, bool sparse, bool trim)
+{
+	struct sparse_writer *w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->out = out;
+	w->sparse = sparse;
+	w->trim = trim;
+
+	if (sparse && fwrite(SPARSE_MAGIC, 1, 8, out) != 8) {
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+static int sparse_write_segments(struct sparse_writer *w, const uint8_t *data, uint32_t len)
+{
+	uint32_t i = 0;
+
+	while (i < len) {
+		while (i < len && data[i] == 0xFF)
+			i++;
+		if (i == len)
+			break;
+
+		/* Extend the segment over short runs of 0xFF */
+		uint32_t start = i, last = i;
+		while (i < len) {
+			if (data[i] != 0xFF) {
+				last = ++i;
+				continue;
+			}
+			uint32_t run = i;
+			while (run < len && data[run] == 0xFF)
+				run++;
+			if (run - i >= SPARSE_MIN_GAP || run == len)
+				break;
+			i = run;
+		}
+
+		if (write_segment(w, w->pos + start, data + start, last - start))
+			return -1;
+		w->end = w->pos + last;
+		i = last;
+	}
+	return 0;
+}
+
+static int sparse_write_plain(struct sparse_writer *w, const uint8_t *data, uint32_t len)
+{
+	if (!w->trim)
+		return fwrite(data, 1, len, w->out) == len ? 0 : -1;
+
+	uint32_t last = len;
+	while (last && data[last - 1] == 0xFF)
+		last--;
+
+	if (!last) {
+		w->pending += len;
+		return 0;
+	}
+
+	if (write_blank(w->out, w->pending) || fwrite(data, 1, last, w->out) != last)
+		return -1;
+	w->pending = len - last;
+	w->end = w->pos + last;
+	return 0;
+}
+
+int sparse_write(struct sparse_writer *w, const uint8_t *data, uint32_t len)
+{
+	int rc = w->sparse ? sparse_write_segments(w, data, len) : sparse_write_plain(w, data, len);
+
+	if (rc) {
+		perror("can't write output file");
+		w->failed = true;
+	}
+	w->pos += len;
+	return rc;
+}
+
+int64_t sparse_close(struct sparse_writer *w)
+{
+	uint64_t size = w->trim ? w->end : w->pos;
+	bool failed = w->failed;
+
+	/* With 'trim' in plain mode, trailing 0xFF were never written */
+	if (!failed && w->sparse)
+		failed = write_segment(w, size, NULL, 0) != 0;
+
+	free(w);
+	return failed ? -1 : (int64_t)size;
+}
+
+bool sparse_detect(FILE *f)
+{
+	char magic[8];
+	bool found = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+		memcmp(magic, SPARSE_MAGIC, sizeof(magic)) == 0;
+
+	rewind(f);
+	return found;
+}
+
+FILE *sparse_expand(FILE *in, long *size)
+{
+	uint8_t header[12];
+	uint8_t buffer[4096];
+	uint64_t pos = 0;
+
+	FILE *out = tmpfile();
+	if (!out)
+		return NULL;
+
+	if (fseek(in, 8, SEEK_SET) == -1)
+		goto error;
+
+	while (true) {
+		if (fread(header, 1, sizeof(header), in) != sizeof(header)) {
+			fprintf(stderr, "sparse image: truncated\n");
+			goto error;
+		}
+
+		uint64_t offset = get_le(header, 8);
+		uint32_t len = get_le(header + 8, 4);
+
+		if (offset < pos) {
+			fprintf(stderr, "sparse image: segment at 0x%" PRIx64 " out of order\n", offset);
+			goto error;
+		}
+		if (write_blank(out, offset - pos))
+			goto error;
+		pos = offset;
+
+		if (!len)
+			break;
+
+		for (uint32_t done = 0; done < len; ) {
+			uint32_t n = (len - done > sizeof(buffer)) ? sizeof(buffer) : len - done;
+			if (fread(buffer, 1, n, in) != n) {
+				fprintf(stderr, "sparse image: truncated\n");
+				goto error;
+			}
+			if (fwrite(buffer, 1, n, out) != n)
+				goto error;
+			done += n;
+		}
+		pos += len;
+	}
+
+	if (fflush(out) || fseek(out, 0, SEEK_SET) == -1)
+		goto error;
+
+	*size = pos;
+	return out;
+
+error:
+	fclose(out);
+	return NULL;
+}
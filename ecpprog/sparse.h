@@ -0,0 +1,47 @@
+/*
+ * Sparse flash images.
+ *
+ * Readback of a mostly erased flash is written as a list of segments that
+ * leaves out runs of 0xFF:
+ *
+ *   "ECPSPRS1"                         magic
+ *   { u64 offset, u32 length, data }   segments, offsets ascending
+ *   { u64 size, u32 0 }                end, size of the whole image
+ *
+ * All integers are little endian, offsets are relative to the start of
+ * the image. Such files are accepted as input wherever a binary image is.
+ */
+
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SPARSE_MAGIC "ECPSPRS1"
+
+struct sparse_writer;
+
+/**
+ * Starts writing an image to 'out'. Without 'sparse' a plain binary is
+ * written. With 'trim' the image ends at the last byte that is not 0xFF.
+ */
+struct sparse_writer *sparse_open(FILE *out, bool sparse, bool trim);
+
+/* Appends the next 'len' bytes of the image */
+int sparse_write(struct sparse_writer *w, const uint8_t *data, uint32_t len);
+
+/* Finishes the image and frees 'w', returns the size of the image or -1 */
+int64_t sparse_close(struct sparse_writer *w);
+
+/* True if 'f' starts with SPARSE_MAGIC. Rewinds 'f'. */
+bool sparse_detect(FILE *f);
+
+/**
+ * Expands a sparse image into a temporary file holding the plain binary.
+ * Returns NULL on errors.
+ */
+FILE *sparse_expand(FILE *in, long *size);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Chrome trace event output, see trace.h
+ *
+ * Every event is written with a single fprintf(), so the pipeline threads
+ * can trace alongside the main thread. Those show up as a second track.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+static FILE *trace_file;
+static pthread_t main_thread;
+static struct timespec trace_start;
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - trace_start.tv_sec) * 1e6 + (ts.tv_nsec - trace_start.tv_nsec) * 1e-3;
+}
+
+static int tid(void)
+{
+	return pthread_equal(pthread_self(), main_thread) ? 1 : 2;
+}
+
+static void trace_close(void)
+{
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+int trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file)
+		return -1;
+
+	main_thread = pthread_self();
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ecpprog\"}}");
+	atexit(trace_close);
+	return 0;
+}
+
+void trace_begin(const char *name)
+{
+	if (trace_file)
+		fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+			name, now_us(), tid());
+}
+
+void trace_end(void)
+{
+	if (trace_file)
+		fprintf(trace_file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", now_us(), tid());
+}
+
+void trace_end_bytes(uint64_t bytes)
+{
+	if (trace_file)
+		fprintf(trace_file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"bytes\":%" PRIu64 "}}",
+			now_us(), tid(), bytes);
+}
+
+void trace_end_xfer(uint64_t out, uint64_t in)
+{
+	if (trace_file)
+		fprintf(trace_file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"out\":%" PRIu64 ",\"in\":%" PRIu64 "}}",
+			now_us(), tid(), out, in);
+}
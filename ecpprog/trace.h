@@ -0,0 +1,27 @@
+/*
+ * Timeline of a run in the Chrome trace event format, written with --trace
+ * and viewable in chrome://tracing or Perfetto.
+ *
+ * Spans nest per thread: operations such as the erase, program and verify
+ * phases, flash busy polling, JTAG scans and, innermost, the USB transfers
+ * with their byte counts. Until trace_open() the calls do nothing.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* Starts the trace file, closed again at exit. Returns 0 on success. */
+int trace_open(const char *path);
+
+void trace_begin(const char *name);
+void trace_end(void);
+
+/* Ends the span, recording how many bytes it covered */
+void trace_end_bytes(uint64_t bytes);
+
+/* Ends a USB transfer span, recording the bytes sent and received */
+void trace_end_xfer(uint64_t out, uint64_t in);
+
+#endif
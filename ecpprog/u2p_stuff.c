@@ -51,12 +51,13 @@
 #include "jtag.h"
 #include "dump_hex.h"
 #include "u2p_stuff.h"
+#include "trace.h"
 
 #define	LSC_USER1 0x32
 #define	LSC_USER2 0x38
 
 
-static void set_user_ir(uint8_t ir)
+void set_user_ir(uint8_t ir)
 {
 	uint8_t data[1] = { LSC_USER1 };
 	jtag_go_to_state(STATE_SHIFT_IR);
@@ -70,7 +71,7 @@ static void set_user_ir(uint8_t ir)
 	jtag_go_to_state(STATE_RUN_TEST_IDLE);
 }
 
-static void rw_user_data(uint8_t *data, int bits)
+void rw_user_data(uint8_t *data, int bits)
 {
 	uint8_t inst[1];
 	inst[0] = LSC_USER2;
@@ -175,9 +176,11 @@ int user_read_memory(uint32_t address, int words, uint8_t *dest)
 		read_cmd[4] = (uint8_t)caddr;  caddr >>= 8;
 		read_cmd[6] = (uint8_t)caddr;
 		read_cmd[8] = (uint8_t)(now - 1);
+		trace_begin("user_read_memory");
 		set_user_ir(5);
 		rw_user_data(read_cmd, 80);
 		int fifo = read_fifo(dest, 4*now);
+		trace_end_bytes(fifo);
 		if (!fifo)
 			break;
 		address += 4*now;
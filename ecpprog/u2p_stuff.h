@@ -1,6 +1,10 @@
 #ifndef U2P_STUFF_H
 #include <stdint.h>
 
+/* USER1 selects a register of the user JTAG block, USER2 shifts it */
+void set_user_ir(uint8_t ir);
+void rw_user_data(uint8_t *data, int bits);
+
 uint32_t user_read_id();
 int user_read_memory(uint32_t address, int words, uint8_t *dest);
 void user_write_memory(uint32_t address, int words, uint32_t *src);
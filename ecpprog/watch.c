@@ -0,0 +1,152 @@
+/*
+ * File change notification, see watch.h
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+/* A change is reported once the file has been quiet for this long */
+#define WATCH_SETTLE_MS 100
+#define WATCH_POLL_MS 250
+
+struct watch {
+	char *path;
+	const char *name; /* last component of 'path' */
+#ifdef __linux__
+	int fd;
+#else
+	struct stat st;
+#endif
+};
+
+#ifdef __linux__
+
+/* Reads pending events, returns 1 if one of them is about the watched file */
+static int read_events(struct watch *w)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int found = 0;
+
+	ssize_t len = read(w->fd, buffer, sizeof(buffer));
+	if (len <= 0)
+		return -1;
+
+	for (char *p = buffer; p < buffer + len; ) {
+		struct inotify_event *ev = (struct inotify_event *)p;
+		if (ev->len && !strcmp(ev->name, w->name))
+			found = 1;
+		p += sizeof(struct inotify_event) + ev->len;
+	}
+	return found;
+}
+
+struct watch *watch_open(const char *path)
+{
+	struct watch *w = calloc(1, sizeof(*w));
+	if (!w || !(w->path = strdup(path))) {
+		free(w);
+		return NULL;
+	}
+
+	char *slash = strrchr(w->path, '/');
+	const char *dir = ".";
+	if (slash) {
+		*slash = 0;
+		dir = (slash == w->path) ? "/" : w->path;
+		w->name = slash + 1;
+	} else {
+		w->name = w->path;
+	}
+
+	w->fd = inotify_init1(IN_CLOEXEC);
+	if (w->fd < 0 || inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		if (w->fd >= 0)
+			close(w->fd);
+		free(w->path);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+int watch_wait(struct watch *w)
+{
+	int rc;
+	while ((rc = read_events(w)) == 0)
+		;
+	if (rc < 0)
+		return -1;
+
+	/* Toolchains may write the file more than once */
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+	while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+		if (read_events(w) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+void watch_close(struct watch *w)
+{
+	close(w->fd);
+	free(w->path);
+	free(w);
+}
+
+#else
+
+static int changed(const struct stat *a, const struct stat *b)
+{
+	return a->st_mtime != b->st_mtime || a->st_size != b->st_size;
+}
+
+struct watch *watch_open(const char *path)
+{
+	struct watch *w = calloc(1, sizeof(*w));
+	if (!w || !(w->path = strdup(path))) {
+		free(w);
+		return NULL;
+	}
+	w->name = w->path;
+	stat(w->path, &w->st);
+	return w;
+}
+
+int watch_wait(struct watch *w)
+{
+	struct stat st;
+
+	do {
+		usleep(WATCH_POLL_MS * 1000);
+	} while (stat(w->path, &st) || !changed(&st, &w->st));
+
+	/* Wait for the writer to finish */
+	do {
+		w->st = st;
+		usleep(WATCH_SETTLE_MS * 1000);
+	} while (!stat(w->path, &st) && changed(&st, &w->st));
+
+	w->st = st;
+	return 0;
+}
+
+void watch_close(struct watch *w)
+{
+	free(w->path);
+	free(w);
+}
+
+#endif
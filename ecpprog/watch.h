@@ -0,0 +1,27 @@
+/*
+ * Waiting for a file to be rewritten, for reloading a bitstream whenever
+ * the toolchain produces a new one.
+ *
+ * Uses inotify on Linux and polls the modification time elsewhere.
+ */
+
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+struct watch;
+
+/**
+ * Starts watching 'path'. Its directory is watched, so the file may be
+ * replaced by a rename. Returns NULL on error.
+ */
+struct watch *watch_open(const char *path);
+
+/**
+ * Blocks until 'path' has been written and closed, or moved into place.
+ * Changes in quick succession are reported once. Returns 0, or -1 on error.
+ */
+int watch_wait(struct watch *w);
+
+void watch_close(struct watch *w);
+
+#endif